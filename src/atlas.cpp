@@ -0,0 +1,197 @@
+#include "atlas.h"
+
+#include <algorithm>
+
+using std::vector;
+
+namespace Dodgeball{
+
+Atlas::Region::Region():
+x(0), y(0),
+width(0), height(0){
+}
+
+Atlas::Atlas():
+packed(false){
+}
+
+Atlas::Atlas(const Graphics::Bitmap & sheet, const vector<Region> & regions, bool empty):
+sheet(sheet),
+frames(regions.size()),
+regions(regions),
+packed(true){
+    if (empty){
+        flipped = frames;
+    } else {
+        cut();
+    }
+}
+
+unsigned int Atlas::add(const Graphics::Bitmap & frame){
+    frames.push_back(frame);
+    Region region;
+    region.width = frame.getWidth();
+    region.height = frame.getHeight();
+    regions.push_back(region);
+    return frames.size() - 1;
+}
+
+namespace{
+
+struct Taller{
+    Taller(const vector<Atlas::Region> & regions):
+    regions(regions){
+    }
+
+    bool operator()(unsigned int a, unsigned int b) const {
+        return regions[a].height > regions[b].height;
+    }
+
+    const vector<Atlas::Region> & regions;
+};
+
+}
+
+/* Shelf packing: tallest frames first, left to right along a row until the
+ * row is full and then start a new row under it. Character frames are all
+ * about the same size so the rows come out nearly full.
+ */
+void Atlas::pack(){
+    if (packed){
+        return;
+    }
+    packed = true;
+
+    vector<unsigned int> order;
+    for (unsigned int i = 0; i < regions.size(); i++){
+        /* headless frames are never decoded, leave them as they are */
+        if (regions[i].width > 0 && regions[i].height > 0){
+            order.push_back(i);
+        }
+    }
+
+    if (order.empty()){
+        flipped = frames;
+        return;
+    }
+
+    std::stable_sort(order.begin(), order.end(), Taller(regions));
+
+    int x = 0;
+    int y = 0;
+    int rowHeight = 0;
+    int width = 0;
+    for (vector<unsigned int>::iterator it = order.begin(); it != order.end(); it++){
+        Region & region = regions[*it];
+        if (x > 0 && x + region.width > maxWidth){
+            x = 0;
+            y += rowHeight + padding;
+            rowHeight = 0;
+        }
+
+        region.x = x;
+        region.y = y;
+        x += region.width + padding;
+        rowHeight = std::max(rowHeight, region.height);
+        width = std::max(width, region.x + region.width);
+    }
+
+    sheet = Graphics::Bitmap(width, y + rowHeight);
+    sheet.fill(Graphics::MaskColor());
+
+    for (vector<unsigned int>::iterator it = order.begin(); it != order.end(); it++){
+        const Region & region = regions[*it];
+        frames[*it].Blit(region.x, region.y, sheet);
+    }
+
+    /* drops the loose copies */
+    cut();
+}
+
+bool Atlas::isPacked() const {
+    return packed;
+}
+
+void Atlas::cut(){
+    /* the mask colour is skipped by the flipped draw, so fill with it first */
+    flippedSheet = Graphics::Bitmap(sheet.getWidth(), sheet.getHeight());
+    flippedSheet.fill(Graphics::MaskColor());
+    sheet.drawHFlip(0, 0, flippedSheet);
+
+    flipped = frames;
+    for (unsigned int i = 0; i < regions.size(); i++){
+        const Region & region = regions[i];
+        if (region.width > 0 && region.height > 0){
+            frames[i] = Graphics::Bitmap(sheet, region.x, region.y, region.width, region.height);
+            flipped[i] = Graphics::Bitmap(flippedSheet, flippedSheet.getWidth() - region.x - region.width, region.y, region.width, region.height);
+        }
+    }
+}
+
+const Graphics::Bitmap & Atlas::get(unsigned int index) const {
+    return frames[index];
+}
+
+const Graphics::Bitmap & Atlas::getFlipped(unsigned int index) const {
+    return flipped[index];
+}
+
+const Atlas::Region & Atlas::getRegion(unsigned int index) const {
+    return regions[index];
+}
+
+unsigned int Atlas::size() const {
+    return frames.size();
+}
+
+const Graphics::Bitmap & Atlas::getSheet() const {
+    return sheet;
+}
+
+FrameTable::Frame::Frame():
+index(0){
+}
+
+FrameTable::FrameTable(const Util::ReferenceCount<Atlas> & atlas, const std::string & owner, const vector<uint32_t> & hashes):
+hashes(hashes){
+    for (unsigned int i = 0; i < atlas->size(); i++){
+        Frame frame;
+        frame.atlas = atlas;
+        frame.index = i;
+        frame.owner = owner;
+        frames.push_back(frame);
+    }
+}
+
+void FrameTable::add(const Frame & frame){
+    frames.push_back(frame);
+}
+
+void FrameTable::set(unsigned int index, const Frame & frame){
+    frames[index] = frame;
+}
+
+const FrameTable::Frame & FrameTable::getEntry(unsigned int index) const {
+    return frames[index];
+}
+
+const Graphics::Bitmap & FrameTable::get(unsigned int index) const {
+    const Frame & frame = frames[index];
+    return frame.atlas->get(frame.index);
+}
+
+const Graphics::Bitmap & FrameTable::getFlipped(unsigned int index) const {
+    const Frame & frame = frames[index];
+    return frame.atlas->getFlipped(frame.index);
+}
+
+const Atlas::Region & FrameTable::getRegion(unsigned int index) const {
+    const Frame & frame = frames[index];
+    return frame.atlas->getRegion(frame.index);
+}
+
+unsigned int FrameTable::size() const {
+    return frames.size();
+}
+
+}
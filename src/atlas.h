@@ -0,0 +1,107 @@
+#ifndef _dodgeball_atlas_h
+#define _dodgeball_atlas_h
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include "util/graphics/bitmap.h"
+#include "util/pointer.h"
+
+namespace Dodgeball{
+
+/* All of the frames of a character packed into one bitmap. Frames are
+ * added while the character loads and then pack() copies them into the
+ * sheet, after which every frame is a sub bitmap of the sheet so drawing
+ * any of them reads from the same block of memory.
+ *
+ * pack() also makes a mirror image of the sheet so a frame facing the
+ * other way is a plain blit instead of a flipped one.
+ */
+class Atlas{
+public:
+    Atlas();
+
+    struct Region{
+        Region();
+
+        int x, y;
+        int width, height;
+    };
+
+    /* an atlas that was already packed, see AssetPack. An empty sheet
+     * gives empty frames, for when nothing is drawn.
+     */
+    Atlas(const Graphics::Bitmap & sheet, const std::vector<Region> & regions, bool empty);
+
+    /* returns the index of the frame, only valid before pack() */
+    unsigned int add(const Graphics::Bitmap & frame);
+
+    void pack();
+    bool isPacked() const;
+
+    const Graphics::Bitmap & get(unsigned int index) const;
+    /* the frame mirrored left to right, only after pack() */
+    const Graphics::Bitmap & getFlipped(unsigned int index) const;
+    const Region & getRegion(unsigned int index) const;
+    unsigned int size() const;
+
+    /* the whole sheet, empty if there was nothing to pack */
+    const Graphics::Bitmap & getSheet() const;
+
+protected:
+    /* makes the frames sub bitmaps of the sheet and of its mirror image */
+    void cut();
+
+    /* widest row of frames in the sheet */
+    static const int maxWidth = 1024;
+    /* keeps frames from bleeding into each other if they are ever scaled */
+    static const int padding = 1;
+
+    Graphics::Bitmap sheet;
+    Graphics::Bitmap flippedSheet;
+    /* the loose frames before pack(), sub bitmaps of the sheet after */
+    std::vector<Graphics::Bitmap> frames;
+    std::vector<Graphics::Bitmap> flipped;
+    std::vector<Region> regions;
+    bool packed;
+};
+
+/* The frames of one character by the number its animations show them
+ * with. Every entry is a frame in some atlas, at first the character's own,
+ * but the AnimationManager points an entry at another character's frame
+ * when the two have the same pixels.
+ */
+class FrameTable{
+public:
+    struct Frame{
+        Frame();
+
+        Util::ReferenceCount<Atlas> atlas;
+        unsigned int index;
+        /* the character the frame was loaded for */
+        std::string owner;
+    };
+
+    /* every frame of the atlas in order, hashes as below */
+    FrameTable(const Util::ReferenceCount<Atlas> & atlas, const std::string & owner, const std::vector<uint32_t> & hashes);
+
+    void add(const Frame & frame);
+    void set(unsigned int index, const Frame & frame);
+    const Frame & getEntry(unsigned int index) const;
+
+    /* only once the atlas of the entry is packed */
+    const Graphics::Bitmap & get(unsigned int index) const;
+    const Graphics::Bitmap & getFlipped(unsigned int index) const;
+    const Atlas::Region & getRegion(unsigned int index) const;
+    unsigned int size() const;
+
+    /* hash of the pixels of every entry, empty if the frames were never decoded */
+    std::vector<uint32_t> hashes;
+
+protected:
+    std::vector<Frame> frames;
+};
+
+}
+
+#endif
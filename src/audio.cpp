@@ -0,0 +1,252 @@
+#include "audio.h"
+
+#include "util/music-renderer.h"
+
+#include <fstream>
+#include <iterator>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using std::string;
+using std::vector;
+
+namespace Dodgeball{
+
+AudioException::AudioException(const string & file, int line, const string & reason):
+Exception::Base(file, line),
+reason(reason){
+}
+
+AudioException::AudioException(const AudioException & copy):
+Exception::Base(copy),
+reason(copy.reason){
+}
+
+AudioException::~AudioException() throw(){
+}
+
+Exception::Base * AudioException::copy() const {
+    return new AudioException(*this);
+}
+
+const string AudioException::getReason() const {
+    return reason;
+}
+
+static unsigned int read16(const unsigned char * data){
+    return data[0] | (data[1] << 8);
+}
+
+static unsigned int read32(const unsigned char * data){
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((unsigned int) data[3] << 24);
+}
+
+Pcm::Pcm(const char * wav, unsigned int length){
+    decode(wav, length);
+}
+
+Pcm::Pcm(const string & path){
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if (!in.good()){
+        throw AudioException(__FILE__, __LINE__, "Could not open " + path);
+    }
+    vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (data.empty()){
+        throw AudioException(__FILE__, __LINE__, path + " is empty");
+    }
+    decode(&data[0], data.size());
+}
+
+/* Walks the RIFF chunks for the format and the samples, then converts
+ * every sample to 16 bit stereo. Other rates are brought up to the
+ * mixer's by repeating the nearest sample, which is plenty for the short
+ * 11khz effects the game has.
+ */
+void Pcm::decode(const char * wav, unsigned int length){
+    const unsigned char * data = (const unsigned char *) wav;
+    if (length < 12 || memcmp(data, "RIFF", 4) != 0 || memcmp(data + 8, "WAVE", 4) != 0){
+        throw AudioException(__FILE__, __LINE__, "Not a wav file");
+    }
+
+    unsigned int channels = 0;
+    unsigned int sampleRate = 0;
+    unsigned int bits = 0;
+    const unsigned char * samples = NULL;
+    unsigned int bytes = 0;
+    unsigned int at = 12;
+    while (at + 8 <= length){
+        unsigned int size = read32(data + at + 4);
+        const unsigned char * chunk = data + at + 8;
+        if (size > length - at - 8){
+            size = length - at - 8;
+        }
+        if (memcmp(data + at, "fmt ", 4) == 0 && size >= 16){
+            if (read16(chunk) != 1){
+                throw AudioException(__FILE__, __LINE__, "Only uncompressed wav files can be played");
+            }
+            channels = read16(chunk + 2);
+            sampleRate = read32(chunk + 4);
+            bits = read16(chunk + 14);
+        } else if (memcmp(data + at, "data", 4) == 0){
+            samples = chunk;
+            bytes = size;
+        }
+        /* chunks are padded to an even size */
+        at += 8 + size + (size & 1);
+    }
+
+    if (samples == NULL || (channels != 1 && channels != 2) || (bits != 8 && bits != 16) || sampleRate == 0){
+        throw AudioException(__FILE__, __LINE__, "Unsupported wav format");
+    }
+
+    unsigned int frameBytes = channels * bits / 8;
+    unsigned int frames = bytes / frameBytes;
+    unsigned int out = (unsigned int) ((uint64_t) frames * Mixer::rate / sampleRate);
+    this->samples.resize(out * 2);
+    for (unsigned int i = 0; i < out; i++){
+        const unsigned char * frame = samples + (uint64_t) i * sampleRate / Mixer::rate * frameBytes;
+        for (unsigned int channel = 0; channel < 2; channel++){
+            /* mono goes to both sides */
+            const unsigned char * sample = frame + (channel < channels ? channel : 0) * bits / 8;
+            int value = bits == 8 ? (sample[0] - 128) << 8 : (int16_t) read16(sample);
+            this->samples[i * 2 + channel] = (int16_t) value;
+        }
+    }
+}
+
+const vector<int16_t> & Pcm::getSamples() const {
+    return samples;
+}
+
+Mixer::Mixer():
+head(0),
+tail(0),
+active(0),
+gain(unity){
+    out = Util::ReferenceCount<Util::MusicRenderer>(new Util::MusicRenderer(rate, 2));
+    Util::MusicPlayer::play();
+}
+
+Mixer::~Mixer(){
+    pause();
+}
+
+static unsigned int freeSlots(unsigned int head, unsigned int tail, unsigned int size){
+    return (tail + size - head - 1) % size;
+}
+
+void Mixer::play(const Pcm * pcm){
+    if (freeSlots(head, tail, ringSize) < 2){
+        return;
+    }
+    ring[head] = pcm;
+    /* the slot has to be written before render() can see it */
+    __sync_synchronize();
+    head = (head + 1) % ringSize;
+}
+
+/* play() never takes the last slot, so if the ring is full the last thing
+ * in it is already the end of a tick
+ */
+void Mixer::endTick(){
+    if (freeSlots(head, tail, ringSize) == 0){
+        return;
+    }
+    ring[head] = NULL;
+    __sync_synchronize();
+    head = (head + 1) % ringSize;
+}
+
+void Mixer::start(const Pcm * pcm){
+    if (active == maxVoices || pcm->getSamples().empty()){
+        return;
+    }
+    voices[active].pcm = pcm;
+    voices[active].position = 0;
+    active += 1;
+}
+
+void Mixer::setVolume(double volume){
+    Util::MusicPlayer::setVolume(volume);
+    double clamped = volume < 0 ? 0 : (volume > 1 ? 1 : volume);
+    gain = (int) (clamped * unity);
+}
+
+/* Adds with saturation so loud sounds clip instead of wrapping around.
+ * Below unity each sample is scaled first. gain / 2 fits in a signed 16
+ * bits, mulhi keeps the top half of the product with it and times 4 makes
+ * that the product with gain out of unity.
+ */
+static void addSamples(int16_t * mix, const int16_t * add, unsigned int count, int gain, int unity){
+    unsigned int i = 0;
+    if (gain >= unity){
+#ifdef __SSE2__
+        for (; i + 8 <= count; i += 8){
+            __m128i a = _mm_loadu_si128((const __m128i *) (mix + i));
+            __m128i b = _mm_loadu_si128((const __m128i *) (add + i));
+            _mm_storeu_si128((__m128i *) (mix + i), _mm_adds_epi16(a, b));
+        }
+#endif
+        for (; i < count; i++){
+            int sum = mix[i] + add[i];
+            mix[i] = (int16_t) (sum > 32767 ? 32767 : (sum < -32768 ? -32768 : sum));
+        }
+        return;
+    }
+
+#ifdef __SSE2__
+    __m128i scale = _mm_set1_epi16((short) (gain / 2));
+    for (; i + 8 <= count; i += 8){
+        __m128i a = _mm_loadu_si128((const __m128i *) (mix + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (add + i));
+        b = _mm_slli_epi16(_mm_mulhi_epi16(b, scale), 2);
+        _mm_storeu_si128((__m128i *) (mix + i), _mm_adds_epi16(a, b));
+    }
+#endif
+    for (; i < count; i++){
+        int sum = mix[i] + ((add[i] * (gain / 2)) >> 16) * 4;
+        mix[i] = (int16_t) (sum > 32767 ? 32767 : (sum < -32768 ? -32768 : sum));
+    }
+}
+
+void Mixer::render(void * stream, int length){
+    /* start the sounds of every tick that has ended, a tick still being
+     * pushed waits for the next call
+     */
+    unsigned int end = head;
+    __sync_synchronize();
+    for (unsigned int at = tail; at != end; at = (at + 1) % ringSize){
+        if (ring[at] == NULL){
+            for (unsigned int sound = tail; sound != at; sound = (sound + 1) % ringSize){
+                start(ring[sound]);
+            }
+            /* done with the slots before the simulation can reuse them */
+            __sync_synchronize();
+            tail = (at + 1) % ringSize;
+        }
+    }
+
+    int volume = gain;
+    int16_t * mix = (int16_t *) stream;
+    unsigned int count = (unsigned int) length * 2;
+    memset(mix, 0, count * sizeof(int16_t));
+    for (unsigned int i = 0; i < active; /**/){
+        Voice & voice = voices[i];
+        const vector<int16_t> & samples = voice.pcm->getSamples();
+        unsigned int left = samples.size() - voice.position;
+        unsigned int take = left < count ? left : count;
+        addSamples(mix, &samples[voice.position], take, volume, unity);
+        voice.position += take;
+        if (voice.position == samples.size()){
+            active -= 1;
+            voices[i] = voices[active];
+        } else {
+            i += 1;
+        }
+    }
+}
+
+}
@@ -0,0 +1,107 @@
+#ifndef _dodgeball_audio_h
+#define _dodgeball_audio_h
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "util/exceptions/exception.h"
+#include "util/pointer.h"
+#include "util/music-player.h"
+
+namespace Dodgeball{
+
+class AudioException: public Exception::Base {
+public:
+    AudioException(const std::string & file, int line, const std::string & reason);
+    AudioException(const AudioException & copy);
+    virtual ~AudioException() throw();
+
+    virtual void throwSelf() const {
+        throw *this;
+    }
+
+    virtual Exception::Base * copy() const;
+
+protected:
+    virtual const std::string getReason() const;
+
+    std::string reason;
+};
+
+/* A wav file decoded once when it loads into 16 bit stereo samples at
+ * Mixer::rate, so mixing it is only adding numbers. Only uncompressed 8
+ * and 16 bit wav files are understood, anything else throws
+ * AudioException.
+ */
+class Pcm{
+public:
+    Pcm(const char * wav, unsigned int length);
+    explicit Pcm(const std::string & path);
+
+    /* left and right interleaved */
+    const std::vector<int16_t> & getSamples() const;
+
+protected:
+    void decode(const char * wav, unsigned int length);
+
+    std::vector<int16_t> samples;
+};
+
+/* Mixes sounds straight into one stream that the sound device keeps
+ * playing. The backend asks for more samples through render() from its
+ * own audio thread, and render() adds up every voice that is playing and
+ * moves it along. The simulation thread pushes what to start onto a ring
+ * that only it writes to and only render() reads from, so neither side
+ * waits on a lock or allocates. Sounds pushed between two endTick() calls
+ * start together.
+ */
+class Mixer: public Util::MusicPlayer {
+public:
+    Mixer();
+    /* stops the stream before the voices go away */
+    virtual ~Mixer();
+
+    static const unsigned int rate = 44100;
+    /* sounds playing at once, once they are all busy new ones are dropped */
+    static const unsigned int maxVoices = 32;
+
+    /* Only from the simulation thread. A full ring drops the sound but
+     * always leaves a slot for endTick(). The Pcm has to outlive the mixer.
+     */
+    void play(const Pcm * pcm);
+    void endTick();
+
+    /* From the backend, length is in frames of 16 bit stereo at rate */
+    virtual void render(void * stream, int length);
+
+    /* 0 to 1, every voice is scaled by it as it is mixed */
+    virtual void setVolume(double volume);
+
+protected:
+    void start(const Pcm * pcm);
+
+    /* NULL marks the end of a tick */
+    static const unsigned int ringSize = 256;
+    const Pcm * ring[ringSize];
+    /* head is only written by the simulation thread, tail only by render() */
+    volatile unsigned int head;
+    volatile unsigned int tail;
+
+    /* only touched by render() */
+    struct Voice{
+        const Pcm * pcm;
+        /* next sample to play, left and right count separately */
+        unsigned int position;
+    };
+    Voice voices[maxVoices];
+    unsigned int active;
+
+    /* the volume out of unity, read by render() once per call */
+    static const int unity = 32768;
+    volatile int gain;
+};
+
+}
+
+#endif
@@ -0,0 +1,595 @@
+#include "util/init.h"
+#include "util/debug.h"
+#include "util/exceptions/exception.h"
+#include "util/graphics/bitmap.h"
+
+#include "world.h"
+#include "clock.h"
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+
+/* Microbenchmarks for the simulation, runs headless. Prints one JSON
+ * document with a result per benchmark and a list of correctness checks.
+ * With -draw it opens a window and also times drawing the sprites.
+ *
+ *   dodgeball-bench [-filter text] [-samples n] [-draw]
+ */
+
+using std::vector;
+using std::string;
+
+static const unsigned int seed = 1234;
+
+/* Every allocation in the program goes through here so a benchmark can
+ * report how many allocations one operation makes. Loading animations
+ * decodes frames on several threads so the counter is atomic.
+ */
+static unsigned long long allocations = 0;
+
+void * operator new(size_t size) throw(std::bad_alloc){
+    __sync_fetch_and_add(&allocations, 1);
+    void * memory = malloc(size > 0 ? size : 1);
+    if (memory == NULL){
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void * operator new[](size_t size) throw(std::bad_alloc){
+    return operator new(size);
+}
+
+void operator delete(void * memory) throw(){
+    free(memory);
+}
+
+void operator delete[](void * memory) throw(){
+    free(memory);
+}
+
+template <class X>
+static string toString(const X & x){
+    std::ostringstream out;
+    out << x;
+    return out.str();
+}
+
+static Dodgeball::MatchSettings aiMatch(int players, int balls){
+    Dodgeball::MatchSettings settings(seed);
+    settings.humanLeft = false;
+    settings.players = players;
+    settings.balls = balls;
+    return settings;
+}
+
+class Benchmark{
+public:
+    Benchmark(const string & name):
+    name(name){
+    }
+
+    virtual ~Benchmark(){
+    }
+
+    /* called before every sample, not timed */
+    virtual void prepare(){
+    }
+
+    virtual void run() = 0;
+
+    const string name;
+};
+
+struct Result{
+    string name;
+    unsigned long long ops;
+    double nanoseconds;
+    double allocations;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+};
+
+/* nearest rank */
+static double percentile(const vector<double> & sorted, double percent){
+    unsigned int index = (unsigned int) (percent / 100 * sorted.size());
+    if (index >= sorted.size()){
+        index = sorted.size() - 1;
+    }
+    return sorted[index];
+}
+
+/* Each sample runs the operation enough times to take about 50us so the
+ * clock overhead doesn't matter, percentiles are of the per op time of the
+ * samples.
+ */
+static Result measure(Benchmark & benchmark, unsigned int samples){
+    unsigned int batch = 1;
+    while (batch < (1 << 20)){
+        benchmark.prepare();
+        uint64_t start = Dodgeball::currentNanoseconds();
+        for (unsigned int i = 0; i < batch; i++){
+            benchmark.run();
+        }
+        if (Dodgeball::currentNanoseconds() - start > 50000){
+            break;
+        }
+        batch *= 2;
+    }
+
+    vector<double> times;
+    times.reserve(samples);
+    uint64_t total = 0;
+    unsigned long long allocated = 0;
+    for (unsigned int sample = 0; sample < samples; sample++){
+        benchmark.prepare();
+        unsigned long long before = allocations;
+        uint64_t start = Dodgeball::currentNanoseconds();
+        for (unsigned int i = 0; i < batch; i++){
+            benchmark.run();
+        }
+        uint64_t elapsed = Dodgeball::currentNanoseconds() - start;
+        allocated += allocations - before;
+        total += elapsed;
+        times.push_back((double) elapsed / batch);
+    }
+
+    std::sort(times.begin(), times.end());
+
+    Result result;
+    result.name = benchmark.name;
+    result.ops = (unsigned long long) batch * samples;
+    result.nanoseconds = (double) total / result.ops;
+    result.allocations = (double) allocated / result.ops;
+    result.p50 = percentile(times, 50);
+    result.p90 = percentile(times, 90);
+    result.p99 = percentile(times, 99);
+    result.max = times.back();
+    return result;
+}
+
+/* One tick of a whole match. The match starts over when it ends so every
+ * sample is of a match in progress.
+ */
+class WorldRun: public Benchmark {
+public:
+    WorldRun(int players, int balls):
+    Benchmark("World::run/players=" + toString(players) + "/balls=" + toString(balls)),
+    world(aiMatch(players, balls)){
+        for (int i = 0; i < 60; i++){
+            world.run(0, 0);
+        }
+        world.save(start);
+    }
+
+    void prepare(){
+        if (world.isDone()){
+            world.restore(start);
+        }
+    }
+
+    void run(){
+        world.run(0, 0);
+    }
+
+    Dodgeball::World world;
+    Dodgeball::Snapshot start;
+};
+
+/* a lattice of balls across the whole field */
+static vector<Dodgeball::Ball> lattice(const Dodgeball::Field & field){
+    vector<Dodgeball::Ball> balls;
+    for (int x = 0; x < field.getWidth(); x += 15){
+        for (int y = 0; y < field.getHeight(); y += 15){
+            balls.push_back(Dodgeball::Ball(x, y, 0));
+        }
+    }
+    return balls;
+}
+
+/* The part of Team::collisionDetection that looks for the player a ball
+ * touches, with and without the grid. One op is one ball.
+ */
+class FindHit: public Benchmark {
+public:
+    FindHit(int players, bool grid):
+    Benchmark(string("Team::findHit/") + (grid ? "grid" : "linear") + "/players=" + toString(players)),
+    world(aiMatch(players, 1)),
+    grid(grid),
+    next(0),
+    hits(0){
+        /* one tick so the grid is built */
+        world.run(0, 0);
+        balls = lattice(world.getField());
+    }
+
+    void run(){
+        hits += world.team2.findHit(balls[next], grid) != -1;
+        next += 1;
+        if (next == balls.size()){
+            next = 0;
+        }
+    }
+
+    Dodgeball::World world;
+    bool grid;
+    vector<Dodgeball::Ball> balls;
+    unsigned int next;
+    int hits;
+};
+
+class GetDrawables: public Benchmark {
+public:
+    GetDrawables(int players):
+    Benchmark("World::getDrawables/players=" + toString(players)),
+    world(aiMatch(players, 1)),
+    count(0){
+        world.run(0, 0);
+    }
+
+    void run(){
+        count += world.getDrawables().size();
+    }
+
+    Dodgeball::World world;
+    unsigned int count;
+};
+
+class AnimationFind: public Benchmark {
+public:
+    AnimationFind(const Util::ReferenceCount<Dodgeball::AnimationManager> & animations):
+    Benchmark("Animation::find"),
+    walk(animations->getAnimation("alex", "walk")),
+    ticks(0),
+    frames(0){
+    }
+
+    void run(){
+        ticks += 1;
+        frames += walk->find(ticks, true)->frame;
+    }
+
+    Util::ReferenceCount<Dodgeball::Animation> walk;
+    unsigned int ticks;
+    unsigned int frames;
+};
+
+/* what a player pays to switch animation */
+class AnimationStart: public Benchmark {
+public:
+    AnimationStart(const Util::ReferenceCount<Dodgeball::AnimationManager> & animations):
+    Benchmark("Animation::start"),
+    walk(animations->getSet("alex").get(Dodgeball::AnimationSet::Walk)),
+    idle(animations->getSet("alex").get(Dodgeball::AnimationSet::Idle)),
+    flip(false){
+    }
+
+    void run(){
+        flip = !flip;
+        (flip ? walk : idle).start(cursor, 0, flip);
+    }
+
+    const Dodgeball::Animation & walk;
+    const Dodgeball::Animation & idle;
+    Dodgeball::Animation::Cursor cursor;
+    bool flip;
+};
+
+class GetTarget: public Benchmark {
+public:
+    GetTarget(int players, bool pass):
+    Benchmark(string(pass ? "World::passTarget" : "World::getTarget") + "/players=" + toString(players)),
+    world(aiMatch(players, 1)),
+    pass(pass),
+    next(0){
+        world.run(0, 0);
+    }
+
+    void run(){
+        const vector<Util::ReferenceCount<Dodgeball::Player> > & players = world.team1.getPlayers();
+        Dodgeball::Player & who = *players[next];
+        if (pass){
+            world.passTarget(who);
+        } else {
+            world.getTarget(who);
+        }
+        next += 1;
+        if (next == players.size()){
+            next = 0;
+        }
+    }
+
+    Dodgeball::World world;
+    bool pass;
+    unsigned int next;
+};
+
+/* A fresh manager has to parse the animation file. Unless -draw is given
+ * the frames themselves are not decoded, with it the load is measured for
+ * several numbers of decoding threads.
+ */
+class LoadAnimations: public Benchmark {
+public:
+    LoadAnimations(unsigned int threads, bool decode):
+    Benchmark(decode ? "AnimationManager::loadAnimations/threads=" + toString(threads) : string("AnimationManager::loadAnimations")),
+    threads(threads){
+    }
+
+    void run(){
+        Dodgeball::AnimationManager animations;
+        animations.setDecodeThreads(threads);
+        animations.getAnimation("alex", "idle");
+    }
+
+    unsigned int threads;
+};
+
+/* The draw sprites phase of World::draw: every player, ball and piece of
+ * text drawn back to front into a bitmap the size of the screen. About
+ * half of the players face left so the mirrored frames get used too.
+ */
+class DrawSprites: public Benchmark {
+public:
+    DrawSprites(int players):
+    Benchmark("World::draw sprites/players=" + toString(players)),
+    world(aiMatch(players, 1)),
+    work(640, 480){
+        for (int i = 0; i < 60; i++){
+            world.run(0, 0);
+        }
+    }
+
+    void run(){
+        const vector<Dodgeball::Drawable*> & draws = world.getDrawables();
+        for (vector<Dodgeball::Drawable*>::const_iterator it = draws.begin(); it != draws.end(); it++){
+            (*it)->draw(work, world.camera);
+        }
+    }
+
+    Dodgeball::World world;
+    Graphics::Bitmap work;
+};
+
+class SnapshotSave: public Benchmark {
+public:
+    SnapshotSave(int players):
+    Benchmark("World::save/players=" + toString(players)),
+    world(aiMatch(players, 1)){
+        for (int i = 0; i < 100; i++){
+            world.run(0, 0);
+        }
+    }
+
+    void run(){
+        world.save(snapshot);
+    }
+
+    Dodgeball::World world;
+    Dodgeball::Snapshot snapshot;
+};
+
+class SnapshotRestore: public Benchmark {
+public:
+    SnapshotRestore(int players):
+    Benchmark("World::restore/players=" + toString(players)),
+    world(aiMatch(players, 1)){
+        for (int i = 0; i < 100; i++){
+            world.run(0, 0);
+        }
+        world.save(snapshot);
+    }
+
+    void run(){
+        world.restore(snapshot);
+    }
+
+    Dodgeball::World world;
+    Dodgeball::Snapshot snapshot;
+};
+
+struct Check{
+    Check(const string & name, bool passed, const string & detail):
+    name(name),
+    passed(passed),
+    detail(detail){
+    }
+
+    string name;
+    bool passed;
+    string detail;
+};
+
+/* the grid, one ball at a time or all binned at once, must find exactly
+ * the player checking everyone finds
+ */
+static Check checkFindHit(int players){
+    Dodgeball::World world(aiMatch(players, 1));
+    world.run(0, 0);
+    vector<Dodgeball::Ball> balls = lattice(world.getField());
+    vector<Dodgeball::Ball*> all;
+    for (unsigned int i = 0; i < balls.size(); i++){
+        all.push_back(&balls[i]);
+    }
+    vector<int> hits;
+    world.team2.findHits(all, hits);
+    int mismatch = 0;
+    for (unsigned int i = 0; i < balls.size(); i++){
+        int linear = world.team2.findHit(balls[i], false);
+        if (linear != world.team2.findHit(balls[i], true) || linear != hits[i]){
+            mismatch += 1;
+        }
+    }
+    return Check("findHit grid matches linear/players=" + toString(players), mismatch == 0,
+                 toString(mismatch) + " of " + toString(balls.size()) + " balls differ");
+}
+
+/* a restored world has to play out exactly as it did the first time */
+static Check checkSnapshot(int players){
+    Dodgeball::World world(aiMatch(players, 1));
+    for (int i = 0; i < 100; i++){
+        world.run(0, 0);
+    }
+
+    Dodgeball::Snapshot snapshot;
+    world.save(snapshot);
+    for (int i = 0; i < 200; i++){
+        world.run(0, 0);
+    }
+    uint32_t first = world.hash();
+
+    world.restore(snapshot);
+    for (int i = 0; i < 200; i++){
+        world.run(0, 0);
+    }
+    uint32_t second = world.hash();
+
+    return Check("snapshot replays exactly/players=" + toString(players), first == second,
+                 toString(snapshot.size()) + " bytes");
+}
+
+static string quote(const string & text){
+    string out = "\"";
+    for (unsigned int i = 0; i < text.size(); i++){
+        if (text[i] == '"' || text[i] == '\\'){
+            out += '\\';
+        }
+        out += text[i];
+    }
+    return out + "\"";
+}
+
+static void writeJson(std::ostream & out, const vector<Result> & results, const vector<Check> & checks){
+    out << "{" << std::endl;
+    out << "  \"seed\": " << seed << "," << std::endl;
+    out << "  \"benchmarks\": [" << std::endl;
+    for (unsigned int i = 0; i < results.size(); i++){
+        const Result & result = results[i];
+        out << "    {\"name\": " << quote(result.name)
+            << ", \"ops\": " << result.ops
+            << ", \"ns_per_op\": " << result.nanoseconds
+            << ", \"allocs_per_op\": " << result.allocations
+            << ", \"p50_ns\": " << result.p50
+            << ", \"p90_ns\": " << result.p90
+            << ", \"p99_ns\": " << result.p99
+            << ", \"max_ns\": " << result.max
+            << "}" << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+    out << "  ]," << std::endl;
+    out << "  \"checks\": [" << std::endl;
+    for (unsigned int i = 0; i < checks.size(); i++){
+        const Check & check = checks[i];
+        out << "    {\"name\": " << quote(check.name)
+            << ", \"passed\": " << (check.passed ? "true" : "false")
+            << ", \"detail\": " << quote(check.detail)
+            << "}" << (i + 1 < checks.size() ? "," : "") << std::endl;
+    }
+    out << "  ]" << std::endl;
+    out << "}" << std::endl;
+}
+
+static bool isArg(const char * arg, const char * what){
+    return strcmp(arg, what) == 0;
+}
+
+int main(int argc, char ** argv){
+    string filter;
+    unsigned int samples = 200;
+    bool draw = false;
+    for (int i = 1; i < argc; i++){
+        if (isArg(argv[i], "-filter") && i + 1 < argc){
+            i += 1;
+            filter = argv[i];
+        } else if (isArg(argv[i], "-samples") && i + 1 < argc){
+            i += 1;
+            samples = atoi(argv[i]);
+        } else if (isArg(argv[i], "-draw")){
+            draw = true;
+        }
+    }
+    if (samples < 1){
+        samples = 1;
+    }
+
+    if (draw){
+        Global::init(Global::WINDOWED);
+    } else {
+        Dodgeball::setHeadless(true);
+        Global::initNoGraphics();
+    }
+
+    vector<Result> results;
+    vector<Check> checks;
+    try{
+        Util::ReferenceCount<Dodgeball::AnimationManager> animations = Dodgeball::AnimationManager::instance();
+
+        vector<Benchmark*> benchmarks;
+        const int counts[] = {3, 12, 50, 200};
+        for (unsigned int c = 0; c < sizeof(counts) / sizeof(int); c++){
+            benchmarks.push_back(new WorldRun(counts[c], 1));
+            benchmarks.push_back(new FindHit(counts[c], false));
+            benchmarks.push_back(new FindHit(counts[c], true));
+            benchmarks.push_back(new GetDrawables(counts[c]));
+            benchmarks.push_back(new GetTarget(counts[c], false));
+            benchmarks.push_back(new GetTarget(counts[c], true));
+            benchmarks.push_back(new SnapshotSave(counts[c]));
+            benchmarks.push_back(new SnapshotRestore(counts[c]));
+        }
+        const int balls[] = {8, 64};
+        for (unsigned int b = 0; b < sizeof(balls) / sizeof(int); b++){
+            benchmarks.push_back(new WorldRun(50, balls[b]));
+        }
+        benchmarks.push_back(new AnimationFind(animations));
+        benchmarks.push_back(new AnimationStart(animations));
+        if (draw){
+            const unsigned int threads[] = {1, 2, 4, 8};
+            for (unsigned int t = 0; t < sizeof(threads) / sizeof(unsigned int); t++){
+                benchmarks.push_back(new LoadAnimations(threads[t], true));
+            }
+        } else {
+            benchmarks.push_back(new LoadAnimations(1, false));
+        }
+        if (draw){
+            const int drawCounts[] = {12, 200};
+            for (unsigned int c = 0; c < sizeof(drawCounts) / sizeof(int); c++){
+                benchmarks.push_back(new DrawSprites(drawCounts[c]));
+            }
+        }
+
+        for (vector<Benchmark*>::iterator it = benchmarks.begin(); it != benchmarks.end(); it++){
+            Benchmark * benchmark = *it;
+            if (benchmark->name.find(filter) != string::npos){
+                results.push_back(measure(*benchmark, samples));
+            }
+            delete benchmark;
+        }
+
+        for (unsigned int c = 0; c < sizeof(counts) / sizeof(int); c++){
+            checks.push_back(checkFindHit(counts[c]));
+            checks.push_back(checkSnapshot(counts[c]));
+        }
+    } catch (const Exception::Base & fail){
+        Global::debug(0) << "Problem: " << fail.getTrace() << std::endl;
+    }
+
+    writeJson(std::cout, results, checks);
+
+    Dodgeball::SoundManager::destroy();
+    Dodgeball::AnimationManager::destroy();
+    Dodgeball::AssetPack::destroy();
+    Global::close();
+
+    for (unsigned int i = 0; i < checks.size(); i++){
+        if (!checks[i].passed){
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef _dodgeball_clock_h
+#define _dodgeball_clock_h
+
+#include <stdint.h>
+#include <time.h>
+
+namespace Dodgeball{
+
+/* Monotonic wall clock for timing the simulation */
+static inline uint64_t currentNanoseconds(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static inline double currentSeconds(){
+    return currentNanoseconds() / 1000000000.0;
+}
+
+}
+
+#endif
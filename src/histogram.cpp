@@ -0,0 +1,99 @@
+#include "histogram.h"
+
+#include <iomanip>
+
+namespace Dodgeball{
+
+Histogram::Histogram(){
+    reset();
+}
+
+void Histogram::reset(){
+    for (int i = 0; i < buckets; i++){
+        counts[i] = 0;
+    }
+    count = 0;
+    total = 0;
+    max = 0;
+}
+
+/* Values below subCount get a bucket each. Above that the top subBits bits
+ * of the value pick one of half buckets for its power of two.
+ */
+int Histogram::bucket(uint64_t value){
+    if (value < (uint64_t) subCount){
+        return value;
+    }
+    int top = 63 - __builtin_clzll(value);
+    int shift = top - (subBits - 1);
+    int sub = value >> shift;
+    return subCount + (shift - 1) * half + (sub - half);
+}
+
+uint64_t Histogram::highest(int bucket){
+    if (bucket < subCount){
+        return bucket;
+    }
+    int shift = (bucket - subCount) / half + 1;
+    uint64_t sub = (bucket - subCount) % half + half;
+    return ((sub + 1) << shift) - 1;
+}
+
+void Histogram::add(uint64_t nanoseconds){
+    counts[bucket(nanoseconds)] += 1;
+    count += 1;
+    total += nanoseconds;
+    if (nanoseconds > max){
+        max = nanoseconds;
+    }
+}
+
+uint64_t Histogram::getCount() const {
+    return count;
+}
+
+uint64_t Histogram::getMax() const {
+    return max;
+}
+
+double Histogram::getMean() const {
+    if (count == 0){
+        return 0;
+    }
+    return (double) total / count;
+}
+
+uint64_t Histogram::percentile(double percent) const {
+    if (count == 0){
+        return 0;
+    }
+
+    uint64_t want = (uint64_t) (percent / 100 * count + 0.5);
+    if (want < 1){
+        want = 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < buckets; i++){
+        seen += counts[i];
+        if (seen >= want){
+            uint64_t value = highest(i);
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
+
+void Histogram::write(std::ostream & out, const char * name) const {
+    out << std::fixed << std::setprecision(1)
+        << name
+        << " count " << count
+        << " mean " << getMean() / 1000
+        << " p50 " << percentile(50) / 1000.0
+        << " p95 " << percentile(95) / 1000.0
+        << " p99 " << percentile(99) / 1000.0
+        << " max " << max / 1000.0
+        << " us" << std::endl;
+}
+
+}
@@ -0,0 +1,47 @@
+#ifndef _dodgeball_histogram_h
+#define _dodgeball_histogram_h
+
+#include <stdint.h>
+#include <ostream>
+
+namespace Dodgeball{
+
+/* Counts of nanosecond durations in buckets that are 1/16th of a power of
+ * two wide, so any percentile is within about 6% of the real value no
+ * matter how large it is. Adding a value is a couple of shifts.
+ */
+class Histogram{
+public:
+    Histogram();
+
+    void add(uint64_t nanoseconds);
+    void reset();
+
+    uint64_t getCount() const;
+    uint64_t getMax() const;
+    double getMean() const;
+
+    /* the largest value in the bucket that holds the given percent, 0 to 100 */
+    uint64_t percentile(double percent) const;
+
+    /* one line: count, mean, p50, p95, p99 and max in microseconds */
+    void write(std::ostream & out, const char * name) const;
+
+protected:
+    static const int subBits = 5;
+    static const int subCount = 1 << subBits;
+    static const int half = subCount / 2;
+    static const int buckets = subCount + (64 - subBits) * half;
+
+    static int bucket(uint64_t value);
+    static uint64_t highest(int bucket);
+
+    uint64_t counts[buckets];
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+};
+
+}
+
+#endif
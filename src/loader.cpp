@@ -0,0 +1,205 @@
+#include "loader.h"
+
+#include "util/thread.h"
+#include "util/debug.h"
+#include "util/exceptions/exception.h"
+
+using std::string;
+using std::vector;
+using std::map;
+
+namespace Dodgeball{
+
+class AssetLoader::CharacterFuture: public Util::Future<map<string, Util::ReferenceCount<Animation> > > {
+public:
+    CharacterFuture(const AnimationManager & animations, const string & name, const Filesystem::AbsolutePath & directory, const std::set<uint32_t> & known):
+    animations(animations),
+    name(name),
+    directory(directory),
+    known(known){
+        start();
+    }
+
+    virtual ~CharacterFuture(){
+    }
+
+protected:
+    virtual void compute(){
+        set(animations.loadAnimations(name, directory, known));
+    }
+
+    const AnimationManager & animations;
+    const string name;
+    const Filesystem::AbsolutePath directory;
+    /* frames the manager had when the load started */
+    const std::set<uint32_t> known;
+};
+
+class AssetLoader::SoundFuture: public Util::Future<Util::ReferenceCount<Pcm> > {
+public:
+    SoundFuture(const AssetPack * pack, const Path::RelativePath & path, const Filesystem::AbsolutePath & file):
+    pack(pack),
+    path(path),
+    file(file){
+        start();
+    }
+
+    virtual ~SoundFuture(){
+    }
+
+protected:
+    virtual void compute(){
+        set(SoundManager::loadSound(pack, path, file));
+    }
+
+    const AssetPack * pack;
+    const Path::RelativePath path;
+    const Filesystem::AbsolutePath file;
+};
+
+AssetLoader::AssetLoader(AnimationManager & animations, SoundManager & sounds):
+animations(animations),
+sounds(sounds),
+pack(AssetPack::instance()),
+requested(0),
+finished(0),
+required(0){
+}
+
+/* the threads still point at the managers so let them finish first */
+template <class X>
+static void finish(Util::Future<X> * future){
+    try{
+        future->get();
+    } catch (const Exception::Base & fail){
+    }
+    delete future;
+}
+
+AssetLoader::~AssetLoader(){
+    for (vector<Character>::iterator it = characters.begin(); it != characters.end(); it++){
+        if (it->future != NULL){
+            finish(it->future);
+        }
+    }
+
+    for (vector<SoundLoad>::iterator it = soundLoads.begin(); it != soundLoads.end(); it++){
+        if (it->future != NULL){
+            finish(it->future);
+        }
+    }
+}
+
+void AssetLoader::loadCharacter(const string & name, bool required){
+    if (animations.has(name)){
+        return;
+    }
+
+    /* Storage isn't safe to use from the loading threads, so everything is
+     * looked up here. Something that isn't there is left for whatever needs
+     * it to load and report.
+     */
+    Filesystem::AbsolutePath directory;
+    try{
+        directory = animations.locate(name);
+    } catch (const Exception::Base & fail){
+        Global::debug(0) << "Could not find " << name << ": " << fail.getTrace() << std::endl;
+        return;
+    }
+
+    Character character;
+    character.name = name;
+    character.required = required;
+    character.future = new CharacterFuture(animations, name, directory, animations.knownFrames());
+    characters.push_back(character);
+    requested += 1;
+    if (required){
+        this->required += 1;
+    }
+}
+
+void AssetLoader::loadSound(const Path::RelativePath & path){
+    Filesystem::AbsolutePath file;
+    try{
+        file = SoundManager::locateSound(pack.raw(), path);
+    } catch (const Exception::Base & fail){
+        Global::debug(0) << "Could not find " << path.path() << ": " << fail.getTrace() << std::endl;
+        return;
+    }
+
+    sounds.expect(path);
+    SoundLoad load;
+    load.path = path;
+    load.future = new SoundFuture(pack.raw(), path, file);
+    soundLoads.push_back(load);
+    requested += 1;
+}
+
+/* Something that failed to load is counted as finished anyway. Whatever
+ * needs it will try to load it again itself and report the problem.
+ */
+void AssetLoader::poll(){
+    loading = "";
+
+    for (vector<Character>::iterator it = characters.begin(); it != characters.end(); it++){
+        Character & character = *it;
+        if (character.future == NULL){
+            continue;
+        }
+        if (!character.future->isDone()){
+            loading = character.name;
+            continue;
+        }
+
+        try{
+            animations.add(character.name, character.future->get());
+        } catch (const Exception::Base & fail){
+            Global::debug(0) << "Could not load " << character.name << ": " << fail.getTrace() << std::endl;
+        }
+        delete character.future;
+        character.future = NULL;
+        finished += 1;
+        if (character.required){
+            required -= 1;
+        }
+    }
+
+    for (vector<SoundLoad>::iterator it = soundLoads.begin(); it != soundLoads.end(); it++){
+        SoundLoad & load = *it;
+        if (load.future == NULL){
+            continue;
+        }
+        if (!load.future->isDone()){
+            loading = load.path.path();
+            continue;
+        }
+
+        Util::ReferenceCount<Pcm> sound;
+        try{
+            sound = load.future->get();
+        } catch (const Exception::Base & fail){
+            Global::debug(0) << "Could not load " << load.path.path() << ": " << fail.getTrace() << std::endl;
+        }
+        sounds.add(load.path, sound);
+        delete load.future;
+        load.future = NULL;
+        finished += 1;
+    }
+}
+
+bool AssetLoader::ready() const {
+    return required == 0;
+}
+
+double AssetLoader::progress() const {
+    if (requested == 0){
+        return 1;
+    }
+    return (double) finished / requested;
+}
+
+const string & AssetLoader::getLoading() const {
+    return loading;
+}
+
+}
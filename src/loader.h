@@ -0,0 +1,70 @@
+#ifndef _dodgeball_loader_h
+#define _dodgeball_loader_h
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "util/pointer.h"
+#include "util/file-system.h"
+#include "world.h"
+
+namespace Dodgeball{
+
+/* Loads characters and sounds on background threads, one future each, so
+ * the window keeps drawing while they load. Call poll() from the main
+ * thread every tick to hand whatever has finished to the managers.
+ *
+ * Characters can be required, the match can't start until they are in.
+ * Sounds are never required: until one arrives playing it does nothing.
+ */
+class AssetLoader{
+public:
+    AssetLoader(AnimationManager & animations, SoundManager & sounds);
+    /* waits for anything still loading */
+    virtual ~AssetLoader();
+
+    void loadCharacter(const std::string & name, bool required);
+    void loadSound(const Path::RelativePath & path);
+
+    void poll();
+
+    /* every required character has been given to the AnimationManager */
+    bool ready() const;
+    /* how much of everything asked for has arrived, 0 to 1 */
+    double progress() const;
+
+    const std::string & getLoading() const;
+
+protected:
+    class CharacterFuture;
+    class SoundFuture;
+
+    struct Character{
+        std::string name;
+        bool required;
+        CharacterFuture * future;
+    };
+
+    struct SoundLoad{
+        Path::RelativePath path;
+        SoundFuture * future;
+    };
+
+    AnimationManager & animations;
+    SoundManager & sounds;
+    /* looked up on the main thread, the futures only read it */
+    Util::ReferenceCount<AssetPack> pack;
+
+    std::vector<Character> characters;
+    std::vector<SoundLoad> soundLoads;
+    unsigned int requested;
+    unsigned int finished;
+    unsigned int required;
+    /* name of something that hasn't arrived yet, for the loading screen */
+    std::string loading;
+};
+
+}
+
+#endif
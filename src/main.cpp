@@ -9,6 +9,19 @@
 #include "util/exceptions/shutdown_exception.h"
 
 #include "world.h"
+#include "runner.h"
+#include "netplay.h"
+#include "replay.h"
+#include "histogram.h"
+#include "loader.h"
+#include "clock.h"
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
 
 /* Unit is a foot or something */
 
@@ -16,27 +29,123 @@ static double unitsToPixels(double units){
     return units * 10;
 }
 
+/* How long frames take in the main loop, kept across matches */
+class FrameStats{
+public:
+    FrameStats(const std::string & path):
+    path(path),
+    frames(0),
+    ticks(0),
+    multiTick(0),
+    mostTicks(0),
+    ticksThisFrame(0),
+    lastDraw(0){
+    }
+
+    void logicTook(uint64_t nanoseconds){
+        logic.add(nanoseconds);
+        ticks += 1;
+        ticksThisFrame += 1;
+    }
+
+    void drawStarted(){
+        uint64_t now = Dodgeball::currentNanoseconds();
+        if (lastDraw != 0){
+            interval.add(now - lastDraw);
+        }
+        lastDraw = now;
+
+        /* the loop fell behind and ran several ticks for this frame */
+        if (ticksThisFrame > 1){
+            multiTick += 1;
+        }
+        if (ticksThisFrame > mostTicks){
+            mostTicks = ticksThisFrame;
+        }
+        ticksThisFrame = 0;
+        frames += 1;
+    }
+
+    void drawTook(uint64_t nanoseconds){
+        draw.add(nanoseconds);
+    }
+
+    void write() const {
+        std::ofstream out(path.c_str());
+        if (!out){
+            Global::debug(0) << "Could not write frame times to " << path << std::endl;
+            return;
+        }
+        out << "frames " << frames << std::endl;
+        out << "logic ticks " << ticks << std::endl;
+        out << "frames with several ticks " << multiTick;
+        if (frames > 0){
+            out << " (" << 100.0 * multiTick / frames << "%)";
+        }
+        out << std::endl;
+        out << "most ticks in a frame " << mostTicks << std::endl;
+        logic.write(out, "logic");
+        draw.write(out, "draw");
+        interval.write(out, "frame");
+        Global::debug(0) << "Wrote frame times to " << path << std::endl;
+    }
+
+    const std::string path;
+    Dodgeball::Histogram logic;
+    Dodgeball::Histogram draw;
+    /* from the start of one draw to the start of the next */
+    Dodgeball::Histogram interval;
+    unsigned long long frames;
+    unsigned long long ticks;
+    unsigned long long multiTick;
+    unsigned int mostTicks;
+    unsigned int ticksThisFrame;
+    uint64_t lastDraw;
+};
+
 class Main: public Util::Logic, public Util::Draw {
 public:
     enum Input{
-        Quit
+        Quit,
+        WriteFrames
     };
 
-    Main():
+    Main(FrameStats & frames, Dodgeball::AssetLoader & loader):
     quit(false),
-    handler(*this){
+    frames(frames),
+    loader(loader),
+    handler(*this),
+    settings((unsigned int) ::time(NULL)),
+    world(settings),
+    recorder(settings){
         map.set(Keyboard::Key_ESC, Quit);
+        map.set(Keyboard::Key_F4, WriteFrames);
     }
 
     void draw(const Graphics::Bitmap & screen){
+        frames.drawStarted();
+        uint64_t start = Dodgeball::currentNanoseconds();
         screen.clear();
         world.draw(screen);
         screen.BlitToScreen();
+        frames.drawTook(Dodgeball::currentNanoseconds() - start);
     }
 
     void run(){
+        uint64_t start = Dodgeball::currentNanoseconds();
         InputManager::handleEvents(map, InputSource(0, 0), handler);
-        world.run();
+        /* sounds that are still loading arrive during the match */
+        loader.poll();
+        Dodgeball::SoundManager::instance()->poll();
+        /* edited animations are swapped in here, between ticks */
+        Dodgeball::AnimationManager::instance()->reload();
+        Dodgeball::AnimationManager::instance()->release(world);
+        unsigned int left = 0;
+        unsigned int right = 0;
+        world.readInput(left, right);
+        recorder.record(left, right);
+        world.run(left, right);
+        frames.logicTook(Dodgeball::currentNanoseconds() - start);
     }
 
     bool done(){
@@ -59,6 +168,10 @@ public:
                     main.quit = true;
                     break;
                 }
+                case WriteFrames: {
+                    main.frames.write();
+                    break;
+                }
             }
         }
 
@@ -69,19 +182,235 @@ public:
     };
 
     bool quit;
+    FrameStats & frames;
+    Dodgeball::AssetLoader & loader;
     Handler handler;
     InputMap<Input> map;
+    Dodgeball::MatchSettings settings;
     Dodgeball::World world;
+    Dodgeball::ReplayRecorder recorder;
 };
 
-static bool run(){
+/* A progress bar until the assets the match can't start without are in */
+class Loading: public Util::Logic, public Util::Draw {
+public:
+    enum Input{
+        Quit
+    };
+
+    Loading(Dodgeball::AssetLoader & loader):
+    quit(false),
+    loader(loader),
+    handler(*this){
+        map.set(Keyboard::Key_ESC, Quit);
+    }
+
+    void draw(const Graphics::Bitmap & screen){
+        screen.clear();
+        const Font & font = Font::getDefaultFont(24, 24);
+        Graphics::Color white = Graphics::makeColor(255, 255, 255);
+        int x1 = screen.getWidth() / 4;
+        int x2 = screen.getWidth() * 3 / 4;
+        int y = screen.getHeight() / 2;
+        font.printf(x1, y - font.getHeight() - 10, white, screen, "Loading %s", 0, loader.getLoading().c_str());
+        screen.rectangle(x1, y, x2, y + 20, white);
+        screen.rectangleFill(x1 + 2, y + 2, x1 + 2 + (int) ((x2 - x1 - 4) * loader.progress()), y + 18, white);
+        screen.BlitToScreen();
+    }
+
+    void run(){
+        InputManager::handleEvents(map, InputSource(0, 0), handler);
+        loader.poll();
+    }
+
+    bool done(){
+        return quit || loader.ready();
+    }
+
+    double ticks(double time){
+        return time;
+    }
+
+    class Handler: public InputHandler<Input> {
+    public:
+        Handler(Loading & loading):
+        loading(loading){
+        }
+
+        void press(const Input & out, Keyboard::unicode_t unicode){
+            loading.quit = true;
+        }
+
+        void release(const Input & out, Keyboard::unicode_t unicode){
+        }
+
+        Loading & loading;
+    };
+
+    bool quit;
+    Dodgeball::AssetLoader & loader;
+    Handler handler;
+    InputMap<Input> map;
+};
+
+/* record is where to save a replay of the match, if not empty. Returns
+ * true if the player quit.
+ */
+static bool run(const std::string & record, FrameStats & frames, Dodgeball::AssetLoader & loader){
+    loader.poll();
+    if (!loader.ready()){
+        Loading loading(loader);
+        Util::standardLoop(loading, loading);
+        if (loading.quit){
+            return true;
+        }
+    }
+
     Keyboard::pushRepeatState(false);
-    Main main;
+    Main main(frames, loader);
     Util::standardLoop(main, main);
     Keyboard::popRepeatState();
+    if (record != ""){
+        main.recorder.save(record, main.world.hash());
+    }
     return main.quit;
 }
 
+/* Run a single ai vs ai match as fast as possible, no window/sound/input */
+static void runHeadless(unsigned int seed, unsigned int maxTicks, int players, int balls, const std::string & record){
+    Dodgeball::MatchSettings settings(seed);
+    settings.humanLeft = false;
+    settings.players = players;
+    settings.balls = balls;
+    Dodgeball::World world(settings);
+    Dodgeball::ReplayRecorder recorder(settings);
+    unsigned int ticks = 0;
+    double start = Dodgeball::currentSeconds();
+    while (ticks < maxTicks && !world.isDone()){
+        recorder.record(0, 0);
+        world.run(0, 0);
+        ticks += 1;
+    }
+    double elapsed = Dodgeball::currentSeconds() - start;
+
+    if (record != ""){
+        recorder.save(record, world.hash());
+    }
+
+    std::cout << "seed " << seed << std::endl;
+    std::cout << "ticks " << ticks << std::endl;
+    std::cout << "seconds " << elapsed << std::endl;
+    if (elapsed > 0){
+        std::cout << "ticks/sec " << ticks / elapsed << std::endl;
+    }
+    std::cout << "winner " << Dodgeball::winnerName(Dodgeball::matchWinner(world)) << std::endl;
+}
+
+/* Play a recorded match back as fast as possible and check it ends the
+ * same way it did when it was recorded
+ */
+static void runReplay(const std::string & path){
+    Dodgeball::ReplayPlayer replay(path);
+    Dodgeball::World world(replay.getSettings());
+
+    unsigned int left = 0;
+    unsigned int right = 0;
+    unsigned int ticks = 0;
+    double start = Dodgeball::currentSeconds();
+    while (replay.next(left, right)){
+        world.run(left, right);
+        ticks += 1;
+    }
+    double elapsed = Dodgeball::currentSeconds() - start;
+
+    std::cout << "replay " << path << std::endl;
+    std::cout << "bytes " << replay.getBytes() << std::endl;
+    std::cout << "seed " << world.getSeed() << std::endl;
+    std::cout << "ticks " << ticks << std::endl;
+    std::cout << "seconds " << elapsed << std::endl;
+    if (elapsed > 0){
+        std::cout << "ticks/sec " << ticks / elapsed << std::endl;
+    }
+    std::cout << "winner " << Dodgeball::winnerName(Dodgeball::matchWinner(world)) << std::endl;
+    std::cout << (world.hash() == replay.getHash() ? "replay matches the recording" : "replay differs from the recording!") << std::endl;
+}
+
+/* Run many headless matches spread over a pool of threads */
+static void runMatches(unsigned int seed, unsigned int maxTicks, int players, int balls, unsigned int matches, unsigned int threads){
+    Dodgeball::MatchSettings settings(seed);
+    settings.players = players;
+    settings.balls = balls;
+    Dodgeball::MatchRunner runner(settings, matches, threads, maxTicks);
+    runner.run();
+    std::cout << "seed " << seed << std::endl;
+    runner.report(std::cout);
+}
+
+/* Presses random buttons for a while, standing in for a person */
+class ScriptedButtons{
+public:
+    ScriptedButtons(unsigned int seed):
+    random(seed),
+    buttons(0),
+    hold(0){
+    }
+
+    unsigned int next(){
+        if (hold == 0){
+            buttons = random.next() & (Dodgeball::Controls::Cycle * 2 - 1);
+            hold = random.rnd(2, 30);
+        }
+        hold -= 1;
+        return buttons;
+    }
+
+    Dodgeball::Random random;
+    unsigned int buttons;
+    int hold;
+};
+
+static void reportSide(const char * side, const Dodgeball::Rollback & session){
+    std::cout << side << " ticks " << session.getTick() << " confirmed " << session.getConfirmed() << std::endl;
+    session.getStats().report(std::cout);
+}
+
+/* Two human teams played by scripted buttons, each side in its own World
+ * and connected by an in-process link with the given delay in ticks
+ */
+static void runNetplay(unsigned int seed, unsigned int maxTicks, int players, int balls, unsigned int latency, unsigned int jitter, unsigned int loss){
+    Dodgeball::MatchSettings settings(seed);
+    settings.humanLeft = true;
+    settings.humanRight = true;
+    settings.players = players;
+    settings.balls = balls;
+    Dodgeball::World leftWorld(settings);
+    Dodgeball::World rightWorld(settings);
+
+    Dodgeball::LoopbackLink link(latency, jitter, loss, seed);
+    Dodgeball::Rollback left(leftWorld, Dodgeball::Team::LeftSide, link.getEnd(0));
+    Dodgeball::Rollback right(rightWorld, Dodgeball::Team::RightSide, link.getEnd(1));
+    ScriptedButtons leftButtons(seed * 2 + 1);
+    ScriptedButtons rightButtons(seed * 2 + 2);
+
+    double start = Dodgeball::currentSeconds();
+    for (unsigned int frame = 0; frame < maxTicks; frame++){
+        link.tick();
+        left.run(leftButtons.next());
+        right.run(rightButtons.next());
+    }
+    double elapsed = Dodgeball::currentSeconds() - start;
+
+    std::cout << "seed " << seed << std::endl;
+    std::cout << "latency " << latency << " jitter " << jitter << " loss " << loss << std::endl;
+    std::cout << "seconds " << elapsed << std::endl;
+    reportSide("left", left);
+    reportSide("right", right);
+}
+
+static bool isArg(const char * arg, const char * what){
+    return strcmp(arg, what) == 0;
+}
+
 static void showWin(){
     Graphics::Bitmap work(320, 240);
     work.clear();
@@ -91,12 +420,121 @@ static void showWin(){
 }
 
 int main(int argc, char ** argv){
+    bool headless = false;
+    unsigned int maxTicks = 100000;
+    unsigned int seed = (unsigned int) time(NULL);
+    int players = 3;
+    int balls = 1;
+    unsigned int matches = 1;
+    unsigned int threads = 1;
+    bool netplay = false;
+    unsigned int latency = 4;
+    unsigned int jitter = 0;
+    unsigned int loss = 0;
+    std::string record;
+    std::string play;
+    std::string frameTimes = "frame-times.txt";
+    bool reload = false;
+    bool memory = false;
+    for (int i = 1; i < argc; i++){
+        if (isArg(argv[i], "-headless")){
+            headless = true;
+        } else if (isArg(argv[i], "-ticks") && i + 1 < argc){
+            i += 1;
+            maxTicks = atoi(argv[i]);
+        } else if (isArg(argv[i], "-seed") && i + 1 < argc){
+            i += 1;
+            seed = strtoul(argv[i], NULL, 10);
+        } else if (isArg(argv[i], "-players") && i + 1 < argc){
+            i += 1;
+            players = atoi(argv[i]);
+        } else if (isArg(argv[i], "-balls") && i + 1 < argc){
+            i += 1;
+            balls = atoi(argv[i]);
+        } else if (isArg(argv[i], "-matches") && i + 1 < argc){
+            i += 1;
+            matches = atoi(argv[i]);
+        } else if (isArg(argv[i], "-threads") && i + 1 < argc){
+            i += 1;
+            threads = atoi(argv[i]);
+        } else if (isArg(argv[i], "-netplay")){
+            netplay = true;
+        } else if (isArg(argv[i], "-latency") && i + 1 < argc){
+            i += 1;
+            latency = atoi(argv[i]);
+        } else if (isArg(argv[i], "-jitter") && i + 1 < argc){
+            i += 1;
+            jitter = atoi(argv[i]);
+        } else if (isArg(argv[i], "-loss") && i + 1 < argc){
+            i += 1;
+            loss = atoi(argv[i]);
+        } else if (isArg(argv[i], "-record") && i + 1 < argc){
+            i += 1;
+            record = argv[i];
+        } else if (isArg(argv[i], "-frames") && i + 1 < argc){
+            i += 1;
+            frameTimes = argv[i];
+        } else if (isArg(argv[i], "-reload")){
+            reload = true;
+        } else if (isArg(argv[i], "-memory")){
+            memory = true;
+        } else if (isArg(argv[i], "-play") && i + 1 < argc){
+            /* replays always play back headless */
+            i += 1;
+            play = argv[i];
+            headless = true;
+        }
+    }
+
+    if (headless){
+        Dodgeball::setHeadless(true);
+        Global::initNoGraphics();
+        try{
+            if (play != ""){
+                runReplay(play);
+            } else if (netplay){
+                runNetplay(seed, maxTicks, players, balls, latency, jitter, loss);
+            } else if (matches > 1 || threads > 1){
+                runMatches(seed, maxTicks, players, balls, matches, threads);
+            } else {
+                runHeadless(seed, maxTicks, players, balls, record);
+            }
+        } catch (const Exception::Base & fail){
+            Global::debug(0) << "Problem: " << fail.getTrace() << std::endl;
+        }
+        Dodgeball::SoundManager::destroy();
+        Dodgeball::AnimationManager::destroy();
+        Dodgeball::AssetPack::destroy();
+        Global::close();
+        return 0;
+    }
+
+    /* -reload only does anything here, and a replay recorded with it would
+     * play back with whatever the animations were at the end
+     */
+    if (reload && record != ""){
+        Global::debug(0) << "-reload can't be used with -record" << std::endl;
+        return 1;
+    }
+
     Global::init(Global::WINDOWED);
     Util::Parameter<Graphics::Bitmap*> use(Graphics::screenParameter, Graphics::getScreenBuffer());
     Util::Parameter<Util::ReferenceCount<Path::RelativePath> > font(Font::defaultFont, Util::ReferenceCount<Path::RelativePath>(new Path::RelativePath("arial.ttf")));
     InputManager input;
+    FrameStats frames(frameTimes);
     try{
-        while (!run()){
+        /* everything loads in the background, only the character is needed
+         * before the first match
+         */
+        if (reload){
+            Dodgeball::AnimationManager::instance()->enableReload();
+        }
+        Dodgeball::AssetLoader loader(*Dodgeball::AnimationManager::instance(), *Dodgeball::SoundManager::instance());
+        loader.loadCharacter("alex", true);
+        loader.loadSound(Filesystem::RelativePath("beat1.wav"));
+        loader.loadSound(Filesystem::RelativePath("super.wav"));
+        loader.loadSound(Filesystem::RelativePath("throw.wav"));
+        while (!run(record, frames, loader)){
             showWin();
         }
     } catch (const ShutdownException & fail){
@@ -106,9 +544,14 @@ int main(int argc, char ** argv){
     } catch (...){
         Global::debug(0) << "Uncaught exception" << std::endl;
     }
+    frames.write();
+    if (memory){
+        Dodgeball::AnimationManager::instance()->report(std::cout);
+    }
 
     Dodgeball::SoundManager::destroy();
     Dodgeball::AnimationManager::destroy();
+    Dodgeball::AssetPack::destroy();
     Global::close();
     Global::debug(0) << "Bye!" << std::endl;
 }
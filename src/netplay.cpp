@@ -0,0 +1,330 @@
+#include "netplay.h"
+#include "clock.h"
+
+#include <iomanip>
+
+using std::vector;
+using std::deque;
+
+namespace Dodgeball{
+
+Packet::Packet():
+ack(0),
+first(0),
+count(0),
+hasHash(false),
+hashTick(0),
+hash(0){
+}
+
+Transport::Transport(){
+}
+
+Transport::~Transport(){
+}
+
+class LoopbackTransport: public Transport {
+public:
+    LoopbackTransport(LoopbackLink & link, int side):
+    link(link),
+    side(side){
+    }
+
+    void send(const Packet & packet){
+        link.send(side, packet);
+    }
+
+    bool receive(Packet & packet){
+        return link.receive(side, packet);
+    }
+
+    LoopbackLink & link;
+    const int side;
+};
+
+LoopbackLink::LoopbackLink(unsigned int latency, unsigned int jitter, unsigned int loss, unsigned int seed):
+latency(latency),
+jitter(jitter),
+loss(loss),
+now(0),
+random(seed){
+}
+
+Util::ReferenceCount<Transport> LoopbackLink::getEnd(int side){
+    return Util::ReferenceCount<Transport>(new LoopbackTransport(*this, side));
+}
+
+void LoopbackLink::tick(){
+    now += 1;
+}
+
+void LoopbackLink::send(int side, const Packet & packet){
+    if (loss > 0 && (unsigned int) random.rnd(100) < loss){
+        return;
+    }
+
+    InFlight send;
+    send.arrive = now + latency;
+    if (jitter > 0){
+        send.arrive += random.rnd(jitter + 1);
+    }
+    send.packet = packet;
+
+    /* keep the queue in arrival order, packets that arrive at the same
+     * time stay in the order they were sent
+     */
+    deque<InFlight> & queue = flight[1 - side];
+    deque<InFlight>::iterator it = queue.end();
+    while (it != queue.begin() && (it - 1)->arrive > send.arrive){
+        it--;
+    }
+    queue.insert(it, send);
+}
+
+bool LoopbackLink::receive(int side, Packet & packet){
+    deque<InFlight> & queue = flight[side];
+    if (queue.empty() || queue.front().arrive > now){
+        return false;
+    }
+    packet = queue.front().packet;
+    queue.pop_front();
+    return true;
+}
+
+RollbackStats::RollbackStats():
+frames(0),
+stalls(0),
+rollbacks(0),
+resimulated(0),
+maxDepth(0),
+resimulateNanoseconds(0),
+checked(0),
+desyncs(0),
+firstDesync(0){
+    for (int i = 0; i < depths; i++){
+        depth[i] = 0;
+    }
+}
+
+void RollbackStats::report(std::ostream & out) const {
+    out << "frames " << frames << std::endl;
+    out << "stalls " << stalls << std::endl;
+    out << "rollbacks " << rollbacks << std::endl;
+    if (rollbacks > 0){
+        out << "average depth " << (double) resimulated / rollbacks << std::endl;
+    }
+    out << "max depth " << maxDepth << std::endl;
+    out << "depths";
+    for (int i = 0; i < depths; i++){
+        out << " " << depth[i];
+    }
+    out << std::endl;
+    if (frames > 0){
+        out << "resimulated ticks/frame " << (double) resimulated / frames << std::endl;
+        out << "resimulate us/frame " << resimulateNanoseconds / 1000.0 / frames << std::endl;
+    }
+    if (resimulated > 0){
+        out << "resimulate us/tick " << resimulateNanoseconds / 1000.0 / resimulated << std::endl;
+    }
+    out << "hashes checked " << checked << std::endl;
+    out << "desyncs " << desyncs << std::endl;
+    if (desyncs > 0){
+        out << "first desync at tick " << firstDesync << std::endl;
+    }
+}
+
+/* nothing has arrived for a remoteTick slot */
+static const unsigned int noTick = (unsigned int) -1;
+
+Rollback::Rollback(World & world, Team::Side local, const Util::ReferenceCount<Transport> & transport):
+world(world),
+local(local),
+transport(transport),
+silent(SoundManager::silent()),
+tick(0),
+confirmed(0),
+remoteAck(0),
+mispredicted(false),
+wrong(0),
+lastReal(0),
+snapshots(maxRollback + 1),
+localButtons(history),
+remoteReal(history),
+remoteTick(history, noTick),
+remoteUsed(history),
+hashes(history),
+peerHash(false),
+peerHashTick(0),
+peerHashValue(0){
+}
+
+unsigned int Rollback::getTick() const {
+    return tick;
+}
+
+unsigned int Rollback::getConfirmed() const {
+    return confirmed;
+}
+
+const RollbackStats & Rollback::getStats() const {
+    return stats;
+}
+
+bool Rollback::run(unsigned int buttons){
+    stats.frames += 1;
+
+    receive();
+    if (mispredicted){
+        rollback(wrong);
+    }
+    checkHash();
+
+    /* Can't guess further ahead than there are snapshots to go back to, or
+     * than the other end can be sent our buttons for.
+     */
+    bool moved = false;
+    if (tick < confirmed + maxRollback && tick < remoteAck + history){
+        localButtons[tick % history] = buttons;
+        simulate();
+        moved = true;
+    } else {
+        stats.stalls += 1;
+    }
+
+    send();
+    return moved;
+}
+
+unsigned int Rollback::remoteButtons(unsigned int tick) const {
+    unsigned int slot = tick % history;
+    if (remoteTick[slot] == tick){
+        return remoteReal[slot];
+    }
+    return lastReal;
+}
+
+void Rollback::receive(){
+    Packet packet;
+    while (transport->receive(packet)){
+        if (packet.ack > remoteAck){
+            remoteAck = packet.ack;
+        }
+
+        for (unsigned int i = 0; i < packet.count && i < (unsigned int) Packet::window; i++){
+            unsigned int at = packet.first + i;
+            /* already have it, or so far ahead the slot is still in use */
+            if (at < confirmed || at >= confirmed + history){
+                continue;
+            }
+
+            unsigned int slot = at % history;
+            if (remoteTick[slot] == at){
+                continue;
+            }
+            remoteTick[slot] = at;
+            remoteReal[slot] = packet.buttons[i];
+
+            if (at < tick && remoteUsed[slot] != packet.buttons[i]){
+                if (!mispredicted || at < wrong){
+                    wrong = at;
+                }
+                mispredicted = true;
+            }
+        }
+
+        while (remoteTick[confirmed % history] == confirmed){
+            lastReal = remoteReal[confirmed % history];
+            confirmed += 1;
+        }
+
+        if (packet.hasHash && (!peerHash || packet.hashTick > peerHashTick)){
+            peerHash = true;
+            peerHashTick = packet.hashTick;
+            peerHashValue = packet.hash;
+        }
+    }
+}
+
+void Rollback::rollback(unsigned int from){
+    uint64_t start = currentNanoseconds();
+
+    unsigned int depth = tick - from;
+    unsigned int end = tick;
+    world.restore(snapshots[from % snapshots.size()]);
+    tick = from;
+
+    Util::ReferenceCount<SoundManager> sounds = world.setSounds(silent);
+    while (tick < end){
+        simulate();
+    }
+    world.setSounds(sounds);
+
+    mispredicted = false;
+
+    stats.rollbacks += 1;
+    stats.resimulated += depth;
+    if (depth > stats.maxDepth){
+        stats.maxDepth = depth;
+    }
+    stats.depth[depth < (unsigned int) RollbackStats::depths ? depth : RollbackStats::depths - 1] += 1;
+    stats.resimulateNanoseconds += currentNanoseconds() - start;
+}
+
+void Rollback::simulate(){
+    world.save(snapshots[tick % snapshots.size()]);
+
+    unsigned int slot = tick % history;
+    unsigned int remote = remoteButtons(tick);
+    remoteUsed[slot] = remote;
+    if (local == Team::LeftSide){
+        world.run(localButtons[slot], remote);
+    } else {
+        world.run(remote, localButtons[slot]);
+    }
+    hashes[slot] = world.hash();
+
+    tick += 1;
+}
+
+/* Only ticks that ran with the real buttons from both ends can be compared */
+void Rollback::checkHash(){
+    if (!peerHash || peerHashTick >= confirmed || peerHashTick >= tick){
+        return;
+    }
+
+    if (peerHashTick + history > tick){
+        stats.checked += 1;
+        if (hashes[peerHashTick % history] != peerHashValue){
+            if (stats.desyncs == 0){
+                stats.firstDesync = peerHashTick;
+            }
+            stats.desyncs += 1;
+        }
+    }
+
+    peerHash = false;
+}
+
+void Rollback::send(){
+    Packet packet;
+    packet.ack = confirmed;
+    packet.first = remoteAck;
+    packet.count = tick - remoteAck;
+    if (packet.count > (unsigned int) Packet::window){
+        packet.count = Packet::window;
+    }
+    for (unsigned int i = 0; i < packet.count; i++){
+        packet.buttons[i] = localButtons[(packet.first + i) % history];
+    }
+
+    unsigned int known = confirmed < tick ? confirmed : tick;
+    if (known > 0){
+        packet.hasHash = true;
+        packet.hashTick = known - 1;
+        packet.hash = hashes[packet.hashTick % history];
+    }
+
+    transport->send(packet);
+}
+
+}
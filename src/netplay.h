@@ -0,0 +1,188 @@
+#ifndef _dodgeball_netplay_h
+#define _dodgeball_netplay_h
+
+#include <vector>
+#include <deque>
+#include <ostream>
+#include <stdint.h>
+
+#include "util/pointer.h"
+#include "world.h"
+
+namespace Dodgeball{
+
+/* What the two ends of a match send each other every tick. Every packet
+ * carries all of the local buttons the other end hasn't acknowledged yet,
+ * so a lost or late packet is covered by the next one.
+ */
+struct Packet{
+    Packet();
+
+    static const int window = 16;
+
+    /* the sender has the receiver's buttons for every tick before ack */
+    unsigned int ack;
+    /* buttons[0] is for tick first */
+    unsigned int first;
+    unsigned int count;
+    unsigned int buttons[window];
+
+    /* hash of the world after simulating hashTick, once the sender knows
+     * both sides' buttons up to that tick
+     */
+    bool hasHash;
+    unsigned int hashTick;
+    uint32_t hash;
+};
+
+/* Delivers packets to the other end of a match. Packets may arrive late,
+ * out of order or not at all.
+ */
+class Transport{
+public:
+    Transport();
+    virtual ~Transport();
+
+    virtual void send(const Packet & packet) = 0;
+    /* false if there is nothing to receive */
+    virtual bool receive(Packet & packet) = 0;
+};
+
+class LoopbackTransport;
+
+/* Two transports connected in the same process, for trying out netplay on
+ * one machine. Packets take latency ticks plus up to jitter more to arrive,
+ * so they can overtake each other, and loss percent of them never arrive.
+ */
+class LoopbackLink{
+public:
+    LoopbackLink(unsigned int latency, unsigned int jitter, unsigned int loss, unsigned int seed);
+
+    /* side 0 sends to side 1 and the other way around */
+    Util::ReferenceCount<Transport> getEnd(int side);
+
+    /* moves the clock forward one tick */
+    void tick();
+
+protected:
+    friend class LoopbackTransport;
+
+    struct InFlight{
+        unsigned int arrive;
+        Packet packet;
+    };
+
+    void send(int side, const Packet & packet);
+    bool receive(int side, Packet & packet);
+
+    unsigned int latency;
+    unsigned int jitter;
+    unsigned int loss;
+    unsigned int now;
+    Random random;
+    /* packets on their way to each side */
+    std::deque<InFlight> flight[2];
+};
+
+struct RollbackStats{
+    RollbackStats();
+
+    static const int depths = 16;
+
+    /* calls to run */
+    unsigned int frames;
+    /* frames where the simulation waited for the other end */
+    unsigned int stalls;
+    /* frames that had to go back and re-simulate */
+    unsigned int rollbacks;
+    /* ticks simulated again because a guess was wrong */
+    unsigned int resimulated;
+    unsigned int maxDepth;
+    /* frames by how many ticks they rolled back, the last counts anything deeper */
+    unsigned int depth[depths];
+    uint64_t resimulateNanoseconds;
+    /* hashes compared with the other end and how many differed */
+    unsigned int checked;
+    unsigned int desyncs;
+    unsigned int firstDesync;
+
+    void report(std::ostream & out) const;
+};
+
+/* Plays one side of a two human match against a remote player. The local
+ * buttons are used right away and the remote ones are guessed to be the
+ * same as the last ones that arrived. When the real remote buttons turn out
+ * to be different the world is restored to the tick they were for and
+ * simulated forward again, so neither player waits on the network unless
+ * the guesses get too far ahead.
+ *
+ * Both ends must construct their World from the same MatchSettings.
+ */
+class Rollback{
+public:
+    Rollback(World & world, Team::Side local, const Util::ReferenceCount<Transport> & transport);
+
+    /* ticks the world can be ahead of the last confirmed remote buttons */
+    static const unsigned int maxRollback = 12;
+
+    /* Run one frame with the local buttons, returns false if the world
+     * had to wait for the other end and didn't move.
+     */
+    bool run(unsigned int buttons);
+
+    /* ticks simulated so far */
+    unsigned int getTick() const;
+    /* every tick before this has the real remote buttons */
+    unsigned int getConfirmed() const;
+
+    const RollbackStats & getStats() const;
+
+protected:
+    static const unsigned int history = 64;
+
+    void receive();
+    void rollback(unsigned int from);
+    void simulate();
+    void checkHash();
+    void send();
+
+    unsigned int remoteButtons(unsigned int tick) const;
+
+    World & world;
+    const Team::Side local;
+    Util::ReferenceCount<Transport> transport;
+    /* swapped in while re-simulating so hits aren't heard twice */
+    Util::ReferenceCount<SoundManager> silent;
+
+    unsigned int tick;
+    unsigned int confirmed;
+    /* the remote end has our buttons for every tick before this */
+    unsigned int remoteAck;
+    /* earliest tick that was simulated with a wrong guess */
+    bool mispredicted;
+    unsigned int wrong;
+    /* the remote buttons at confirmed - 1, used as the guess */
+    unsigned int lastReal;
+
+    /* the world before each of the last maxRollback + 1 ticks */
+    std::vector<Snapshot> snapshots;
+    /* ring buffers indexed by tick % history */
+    std::vector<unsigned int> localButtons;
+    std::vector<unsigned int> remoteReal;
+    /* which tick the remoteReal slot holds */
+    std::vector<unsigned int> remoteTick;
+    /* what was used for the remote buttons the last time the tick ran */
+    std::vector<unsigned int> remoteUsed;
+    std::vector<uint32_t> hashes;
+
+    /* latest hash from the other end */
+    bool peerHash;
+    unsigned int peerHashTick;
+    uint32_t peerHashValue;
+
+    RollbackStats stats;
+};
+
+}
+
+#endif
@@ -0,0 +1,518 @@
+#include "pack.h"
+#include "world.h"
+#include "atlas.h"
+#include "audio.h"
+
+#include "util/debug.h"
+#include "util/file-system.h"
+#include "util/graphics/bitmap.h"
+
+#include <fstream>
+#include <algorithm>
+#include <iterator>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using std::string;
+using std::vector;
+using std::map;
+
+namespace Dodgeball{
+
+static const char magic[4] = {'D', 'B', 'P', 'K'};
+/* bump whenever the layout or the way animations are compiled changes */
+static const unsigned int version = 3;
+
+const char * const AssetPack::defaultName = "dodgeball.pack";
+
+PackException::PackException(const string & file, int line, const string & reason):
+Exception::Base(file, line),
+reason(reason){
+}
+
+PackException::PackException(const PackException & copy):
+Exception::Base(copy),
+reason(copy.reason){
+}
+
+PackException::~PackException() throw(){
+}
+
+Exception::Base * PackException::copy() const {
+    return new PackException(*this);
+}
+
+const string PackException::getReason() const {
+    return reason;
+}
+
+namespace{
+
+/* Everything is little endian and read a byte at a time so the pack works
+ * no matter how the mapping is aligned.
+ */
+class Reader{
+public:
+    Reader(const char * data, size_t length):
+    data((const unsigned char *) data),
+    length(length),
+    position(0){
+    }
+
+    uint32_t read32(){
+        need(4);
+        const unsigned char * at = data + position;
+        position += 4;
+        return (uint32_t) at[0] | ((uint32_t) at[1] << 8) | ((uint32_t) at[2] << 16) | ((uint32_t) at[3] << 24);
+    }
+
+    int32_t readSigned(){
+        return (int32_t) read32();
+    }
+
+    uint64_t read64(){
+        uint64_t low = read32();
+        uint64_t high = read32();
+        return low | (high << 32);
+    }
+
+    const char * readBytes(size_t count){
+        need(count);
+        const char * at = (const char *) data + position;
+        position += count;
+        return at;
+    }
+
+    string readString(){
+        uint32_t size = read32();
+        return string(readBytes(size), size);
+    }
+
+    void need(size_t count){
+        if (length - position < count){
+            throw PackException(__FILE__, __LINE__, "Asset pack is truncated");
+        }
+    }
+
+protected:
+    const unsigned char * data;
+    size_t length;
+    size_t position;
+};
+
+class Writer{
+public:
+    void write32(uint32_t value){
+        out.push_back(value & 0xff);
+        out.push_back((value >> 8) & 0xff);
+        out.push_back((value >> 16) & 0xff);
+        out.push_back((value >> 24) & 0xff);
+    }
+
+    void writeSigned(int32_t value){
+        write32((uint32_t) value);
+    }
+
+    void write64(uint64_t value){
+        write32(value & 0xffffffff);
+        write32(value >> 32);
+    }
+
+    void writeBytes(const char * data, size_t count){
+        out.insert(out.end(), data, data + count);
+    }
+
+    void writeString(const string & value){
+        write32(value.size());
+        writeBytes(value.data(), value.size());
+    }
+
+    vector<char> out;
+};
+
+/* An uncompressed 24 bit bmp of the sheet, so loading hands the whole image to
+ * the graphics backend which converts it a row at a time into its own format.
+ */
+void writeSheet(Writer & out, const Graphics::Bitmap & sheet, int width, int height){
+    int row = (width * 3 + 3) & ~3;
+    int size = 54 + row * height;
+    out.write32(size);
+    out.out.push_back('B');
+    out.out.push_back('M');
+    out.write32(size);
+    out.write32(0);
+    out.write32(54);
+    out.write32(40);
+    out.writeSigned(width);
+    out.writeSigned(height);
+    out.out.push_back(1);
+    out.out.push_back(0);
+    out.out.push_back(24);
+    out.out.push_back(0);
+    out.write32(0);
+    out.write32(row * height);
+    out.write32(2835);
+    out.write32(2835);
+    out.write32(0);
+    out.write32(0);
+    /* bmp rows go bottom up, blue green red, padded to four bytes */
+    for (int y = height - 1; y >= 0; y--){
+        for (int x = 0; x < width; x++){
+            Graphics::Color color = sheet.getPixel(x, y);
+            out.out.push_back(Graphics::getBlue(color));
+            out.out.push_back(Graphics::getGreen(color));
+            out.out.push_back(Graphics::getRed(color));
+        }
+        for (int pad = width * 3; pad < row; pad++){
+            out.out.push_back(0);
+        }
+    }
+}
+
+/* size and modification time of a loose file, false if it isn't there */
+bool statFile(const string & path, uint64_t & size, uint64_t & modified){
+    Filesystem::RelativePath relative(path);
+    if (!Storage::instance().exists(relative)){
+        return false;
+    }
+
+    struct stat info;
+    if (stat(Storage::instance().find(relative).path().c_str(), &info) != 0){
+        return false;
+    }
+    size = info.st_size;
+    modified = info.st_mtime;
+    return true;
+}
+
+}
+
+AssetPack::Blob::Blob():
+data(NULL),
+length(0){
+}
+
+AssetPack::AssetPack(const string & path):
+memory(NULL),
+length(0){
+    int file = open(path.c_str(), O_RDONLY);
+    if (file == -1){
+        throw PackException(__FILE__, __LINE__, "Could not open " + path);
+    }
+
+    struct stat info;
+    if (fstat(file, &info) != 0 || info.st_size == 0){
+        close(file);
+        throw PackException(__FILE__, __LINE__, "Could not read " + path);
+    }
+
+    length = info.st_size;
+    void * mapped = mmap(NULL, length, PROT_READ, MAP_PRIVATE, file, 0);
+    /* the mapping stays valid after the file is closed */
+    close(file);
+    if (mapped == MAP_FAILED){
+        throw PackException(__FILE__, __LINE__, "Could not map " + path);
+    }
+    memory = (const char *) mapped;
+
+    try{
+        Reader reader(memory, length);
+        if (memcmp(reader.readBytes(sizeof(magic)), magic, sizeof(magic)) != 0){
+            throw PackException(__FILE__, __LINE__, path + " is not an asset pack");
+        }
+        if (reader.read32() != version){
+            throw PackException(__FILE__, __LINE__, path + " was made by a different version of dodgeball-pack");
+        }
+
+        uint32_t count = reader.read32();
+        for (uint32_t i = 0; i < count; i++){
+            Source source;
+            source.path = reader.readString();
+            source.size = reader.read64();
+            source.modified = reader.read64();
+            sources.push_back(source);
+        }
+
+        count = reader.read32();
+        for (uint32_t i = 0; i < count; i++){
+            string name = reader.readString();
+            Blob & blob = characters[name];
+            blob.length = reader.read32();
+            blob.data = reader.readBytes(blob.length);
+        }
+
+        count = reader.read32();
+        for (uint32_t i = 0; i < count; i++){
+            string name = reader.readString();
+            Blob & blob = sounds[name];
+            blob.length = reader.read32();
+            blob.data = reader.readBytes(blob.length);
+        }
+    } catch (const PackException & fail){
+        munmap((void *) memory, length);
+        throw;
+    }
+}
+
+AssetPack::~AssetPack(){
+    munmap((void *) memory, length);
+}
+
+Util::ReferenceCount<AssetPack> AssetPack::pack;
+bool AssetPack::looked = false;
+
+Util::ReferenceCount<AssetPack> AssetPack::instance(){
+    if (looked){
+        return pack;
+    }
+    looked = true;
+
+    Filesystem::RelativePath name(defaultName);
+    if (!Storage::instance().exists(name)){
+        return pack;
+    }
+
+    try{
+        Util::ReferenceCount<AssetPack> found(new AssetPack(Storage::instance().find(name).path()));
+        if (found->isStale()){
+            Global::debug(0) << defaultName << " is older than the files it was made from, loading the files instead" << std::endl;
+        } else {
+            pack = found;
+        }
+    } catch (const PackException & fail){
+        Global::debug(0) << "Not using " << defaultName << ": " << fail.getTrace() << std::endl;
+    }
+
+    return pack;
+}
+
+void AssetPack::destroy(){
+    pack = NULL;
+    looked = false;
+}
+
+/* A file that is missing is fine, the pack may have been shipped without them */
+bool AssetPack::isStale() const {
+    for (vector<Source>::const_iterator it = sources.begin(); it != sources.end(); it++){
+        const Source & source = *it;
+        uint64_t size = 0;
+        uint64_t modified = 0;
+        if (statFile(source.path, size, modified) && (size != source.size || modified != source.modified)){
+            return true;
+        }
+    }
+    return false;
+}
+
+bool AssetPack::hasCharacter(const string & name) const {
+    return characters.find(name) != characters.end();
+}
+
+/* The atlas sheet as a bmp, then the rectangle of every frame in
+ * it and the hash of its pixels, then every animation with its keys.
+ */
+map<string, Util::ReferenceCount<Animation> > AssetPack::loadCharacter(const string & name) const {
+    map<string, Blob>::const_iterator found = characters.find(name);
+    if (found == characters.end()){
+        throw PackException(__FILE__, __LINE__, "No character " + name + " in the asset pack");
+    }
+
+    Reader reader(found->second.data, found->second.length);
+
+    int width = reader.read32();
+    int height = reader.read32();
+    uint32_t bytes = reader.read32();
+    const char * image = reader.readBytes(bytes);
+
+    bool empty = isHeadless() || width == 0 || height == 0;
+    Graphics::Bitmap sheet;
+    if (!empty){
+        sheet = Graphics::Bitmap(image, bytes);
+    }
+
+    vector<Atlas::Region> regions(reader.read32());
+    for (vector<Atlas::Region>::iterator it = regions.begin(); it != regions.end(); it++){
+        it->x = reader.readSigned();
+        it->y = reader.readSigned();
+        it->width = reader.readSigned();
+        it->height = reader.readSigned();
+    }
+
+    vector<uint32_t> hashes(reader.read32());
+    for (vector<uint32_t>::iterator it = hashes.begin(); it != hashes.end(); it++){
+        *it = reader.read32();
+    }
+
+    Util::ReferenceCount<Atlas> atlas(new Atlas(sheet, regions, empty));
+    Util::ReferenceCount<FrameTable> table(new FrameTable(atlas, name, hashes));
+
+    map<string, Util::ReferenceCount<Animation> > animations;
+    uint32_t count = reader.read32();
+    for (uint32_t i = 0; i < count; i++){
+        string animation = reader.readString();
+        unsigned int length = reader.read32();
+        unsigned int loopKey = reader.read32();
+        unsigned int loopStart = reader.read32();
+        unsigned int period = reader.read32();
+        vector<Animation::Key> keys(reader.read32());
+        for (vector<Animation::Key>::iterator it = keys.begin(); it != keys.end(); it++){
+            it->start = reader.read32();
+            it->x = reader.readSigned();
+            it->y = reader.readSigned();
+            it->frame = reader.read32();
+            if (it->frame >= regions.size()){
+                throw PackException(__FILE__, __LINE__, "Animation " + animation + " of " + name + " uses a frame that isn't in the pack");
+            }
+        }
+        animations[animation] = Util::ReferenceCount<Animation>(new Animation(table, keys, length, loopKey, loopStart, period));
+    }
+
+    return animations;
+}
+
+bool AssetPack::hasSound(const string & path) const {
+    return sounds.find(path) != sounds.end();
+}
+
+Util::ReferenceCount<Pcm> AssetPack::loadSound(const string & path) const {
+    map<string, Blob>::const_iterator found = sounds.find(path);
+    if (found == sounds.end()){
+        return Util::ReferenceCount<Pcm>(NULL);
+    }
+    return Util::ReferenceCount<Pcm>(new Pcm(found->second.data, found->second.length));
+}
+
+static vector<char> readFile(const string & path){
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if (!in.good()){
+        throw PackException(__FILE__, __LINE__, "Could not read " + path);
+    }
+    return vector<char>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void AssetPack::write(const string & path, AnimationManager & manager, const vector<string> & characterNames, const vector<string> & soundNames){
+    vector<string> files;
+    vector<Writer> characterData;
+    for (vector<string>::const_iterator it = characterNames.begin(); it != characterNames.end(); it++){
+        const string & name = *it;
+        const map<string, Util::ReferenceCount<Animation> > & animations = manager.getAnimations(name);
+        if (animations.empty()){
+            throw PackException(__FILE__, __LINE__, "Character " + name + " has no animations");
+        }
+
+        files.push_back(name + "/" + name + ".txt");
+
+        /* Every animation of a character shares one table, but its frames
+         * can be in other characters' atlases. Each character is packed
+         * into a sheet of its own so it loads without the others.
+         */
+        const FrameTable & table = *animations.begin()->second->table;
+        Atlas atlas;
+        for (unsigned int i = 0; i < table.size(); i++){
+            atlas.add(table.get(i));
+        }
+        atlas.pack();
+        const Graphics::Bitmap & sheet = atlas.getSheet();
+        int width = atlas.size() > 0 ? sheet.getWidth() : 0;
+        int height = atlas.size() > 0 ? sheet.getHeight() : 0;
+
+        Writer out;
+        out.write32(width);
+        out.write32(height);
+        if (width > 0 && height > 0){
+            writeSheet(out, sheet, width, height);
+        } else {
+            out.write32(0);
+        }
+
+        out.write32(atlas.size());
+        for (unsigned int i = 0; i < atlas.size(); i++){
+            const Atlas::Region & region = atlas.getRegion(i);
+            out.writeSigned(region.x);
+            out.writeSigned(region.y);
+            out.writeSigned(region.width);
+            out.writeSigned(region.height);
+        }
+
+        out.write32(table.hashes.size());
+        for (vector<uint32_t>::const_iterator hash = table.hashes.begin(); hash != table.hashes.end(); hash++){
+            out.write32(*hash);
+        }
+
+        out.write32(animations.size());
+        for (map<string, Util::ReferenceCount<Animation> >::const_iterator animation = animations.begin(); animation != animations.end(); animation++){
+            const Animation & what = *animation->second;
+            out.writeString(animation->first);
+            out.write32(what.length);
+            out.write32(what.loopKey);
+            out.write32(what.loopStart);
+            out.write32(what.period);
+            out.write32(what.keys.size());
+            for (vector<Animation::Key>::const_iterator key = what.keys.begin(); key != what.keys.end(); key++){
+                out.write32(key->start);
+                out.writeSigned(key->x);
+                out.writeSigned(key->y);
+                out.write32(key->frame);
+            }
+
+            const vector<string> & frames = what.getFiles();
+            for (vector<string>::const_iterator frame = frames.begin(); frame != frames.end(); frame++){
+                files.push_back(name + "/" + *frame);
+            }
+        }
+
+        characterData.push_back(out);
+    }
+
+    vector<vector<char> > soundData;
+    for (vector<string>::const_iterator it = soundNames.begin(); it != soundNames.end(); it++){
+        soundData.push_back(readFile(Storage::instance().find(Filesystem::RelativePath(*it)).path()));
+        files.push_back(*it);
+    }
+
+    Writer out;
+    out.writeBytes(magic, sizeof(magic));
+    out.write32(version);
+
+    std::sort(files.begin(), files.end());
+    files.erase(std::unique(files.begin(), files.end()), files.end());
+    out.write32(files.size());
+    for (vector<string>::iterator it = files.begin(); it != files.end(); it++){
+        uint64_t size = 0;
+        uint64_t modified = 0;
+        if (!statFile(*it, size, modified)){
+            throw PackException(__FILE__, __LINE__, "Could not find " + *it);
+        }
+        out.writeString(*it);
+        out.write64(size);
+        out.write64(modified);
+    }
+
+    out.write32(characterNames.size());
+    for (unsigned int i = 0; i < characterNames.size(); i++){
+        out.writeString(characterNames[i]);
+        out.write32(characterData[i].out.size());
+        out.writeBytes(&characterData[i].out[0], characterData[i].out.size());
+    }
+
+    out.write32(soundNames.size());
+    for (unsigned int i = 0; i < soundNames.size(); i++){
+        out.writeString(soundNames[i]);
+        out.write32(soundData[i].size());
+        if (!soundData[i].empty()){
+            out.writeBytes(&soundData[i][0], soundData[i].size());
+        }
+    }
+
+    std::ofstream file(path.c_str(), std::ios::binary);
+    file.write(&out.out[0], out.out.size());
+    if (!file.good()){
+        throw PackException(__FILE__, __LINE__, "Could not write " + path);
+    }
+}
+
+}
@@ -0,0 +1,104 @@
+#ifndef _dodgeball_pack_h
+#define _dodgeball_pack_h
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+#include "util/exceptions/exception.h"
+#include "util/pointer.h"
+
+namespace Dodgeball{
+
+class Animation;
+class Pcm;
+class AnimationManager;
+
+class PackException: public Exception::Base {
+public:
+    PackException(const std::string & file, int line, const std::string & reason);
+    PackException(const PackException & copy);
+    virtual ~PackException() throw();
+
+    virtual void throwSelf() const {
+        throw *this;
+    }
+
+    virtual Exception::Base * copy() const;
+
+protected:
+    virtual const std::string getReason() const;
+
+    std::string reason;
+};
+
+/* Everything the game loads at startup compiled into one file by
+ * dodgeball-pack: characters with their animations already turned into
+ * timelines and their frames already decoded into an atlas, and the wav
+ * files. The file is mapped into memory and read in place.
+ *
+ * The pack remembers the size and modification time of every file it was
+ * built from. If any of those files are still around and have changed the
+ * pack is stale and the loose files are used instead.
+ */
+class AssetPack{
+public:
+    /* throws PackException if the file can't be mapped or isn't a pack of
+     * this version
+     */
+    AssetPack(const std::string & path);
+    virtual ~AssetPack();
+
+    static const char * const defaultName;
+
+    /* dodgeball.pack in the data directory, NULL if there isn't one or it
+     * is stale. Only call it from the main thread, the pack itself is read
+     * only and can be shared with other threads afterwards.
+     */
+    static Util::ReferenceCount<AssetPack> instance();
+    static void destroy();
+
+    bool isStale() const;
+
+    bool hasCharacter(const std::string & name) const;
+    /* frames are only put in a bitmap when not headless */
+    std::map<std::string, Util::ReferenceCount<Animation> > loadCharacter(const std::string & name) const;
+
+    bool hasSound(const std::string & path) const;
+    /* NULL if the pack doesn't have the sound, decoded from the wav in the pack */
+    Util::ReferenceCount<Pcm> loadSound(const std::string & path) const;
+
+    /* Loads the characters and sounds from the loose files and writes them
+     * all to one pack. Frames have to be decoded, so not headless.
+     */
+    static void write(const std::string & path, AnimationManager & animations, const std::vector<std::string> & characters, const std::vector<std::string> & sounds);
+
+protected:
+    struct Blob{
+        Blob();
+
+        const char * data;
+        uint32_t length;
+    };
+
+    struct Source{
+        std::string path;
+        uint64_t size;
+        uint64_t modified;
+    };
+
+    static Util::ReferenceCount<AssetPack> pack;
+    static bool looked;
+
+    const char * memory;
+    size_t length;
+
+    std::vector<Source> sources;
+    std::map<std::string, Blob> characters;
+    std::map<std::string, Blob> sounds;
+};
+
+}
+
+#endif
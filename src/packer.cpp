@@ -0,0 +1,69 @@
+#include "util/init.h"
+#include "util/debug.h"
+#include "util/exceptions/exception.h"
+
+#include "world.h"
+#include "pack.h"
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <string.h>
+
+/* Compiles the characters and sounds into one asset pack that the game
+ * maps at startup instead of loading the loose files.
+ *
+ *   dodgeball-pack [-o path] [-character name]... [-sound file]...
+ *
+ * Without any -character or -sound it packs everything the game uses. The
+ * frames have to be decoded, so this opens a window while it runs.
+ */
+
+using std::vector;
+using std::string;
+
+static bool isArg(const char * arg, const char * what){
+    return strcmp(arg, what) == 0;
+}
+
+int main(int argc, char ** argv){
+    string output = string("data/") + Dodgeball::AssetPack::defaultName;
+    vector<string> characters;
+    vector<string> sounds;
+    for (int i = 1; i < argc; i++){
+        if (isArg(argv[i], "-o") && i + 1 < argc){
+            i += 1;
+            output = argv[i];
+        } else if (isArg(argv[i], "-character") && i + 1 < argc){
+            i += 1;
+            characters.push_back(argv[i]);
+        } else if (isArg(argv[i], "-sound") && i + 1 < argc){
+            i += 1;
+            sounds.push_back(argv[i]);
+        }
+    }
+
+    if (characters.empty() && sounds.empty()){
+        characters.push_back("alex");
+        sounds.push_back("beat1.wav");
+        sounds.push_back("super.wav");
+        sounds.push_back("throw.wav");
+    }
+
+    Global::init(Global::WINDOWED);
+
+    int status = 0;
+    try{
+        /* a manager without a pack so everything comes from the loose files */
+        Dodgeball::AnimationManager animations;
+        Dodgeball::AssetPack::write(output, animations, characters, sounds);
+        Global::debug(0) << "Wrote " << characters.size() << " characters and " << sounds.size() << " sounds to " << output << std::endl;
+        animations.report(std::cout);
+    } catch (const Exception::Base & fail){
+        Global::debug(0) << "Problem: " << fail.getTrace() << std::endl;
+        status = 1;
+    }
+
+    Global::close();
+    return status;
+}
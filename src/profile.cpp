@@ -0,0 +1,69 @@
+#include "profile.h"
+
+namespace Dodgeball{
+
+namespace Profile{
+
+const char * name(Phase phase){
+    switch (phase){
+        case Input: return "input";
+        case Team1: return "team1";
+        case Team2: return "team2";
+        case Physics: return "physics";
+        case AfterPhysics: return "after physics";
+        case Balls: return "balls";
+        case Collision: return "collision";
+        case FloatingText: return "text";
+        case RemoveDead: return "remove dead";
+        case Camera: return "camera";
+        case DrawField: return "draw field";
+        case DrawDrawables: return "draw sprites";
+        case DrawOverlay: return "draw overlay";
+        case Phases: break;
+    }
+    return "?";
+}
+
+Times::Times(){
+    for (int phase = 0; phase < Phases; phase++){
+        next[phase] = 0;
+        count[phase] = 0;
+        for (int i = 0; i < history; i++){
+            samples[phase][i] = 0;
+        }
+    }
+}
+
+void Times::add(Phase phase, uint64_t nanoseconds){
+    /* a phase that takes over 4 seconds has bigger problems */
+    samples[phase][next[phase]] = nanoseconds > 0xffffffff ? 0xffffffff : (uint32_t) nanoseconds;
+    next[phase] = (next[phase] + 1) % history;
+    if (count[phase] < (unsigned int) history){
+        count[phase] += 1;
+    }
+}
+
+double Times::average(Phase phase) const {
+    if (count[phase] == 0){
+        return 0;
+    }
+    uint64_t total = 0;
+    for (unsigned int i = 0; i < count[phase]; i++){
+        total += samples[phase][i];
+    }
+    return total / 1000.0 / count[phase];
+}
+
+double Times::worst(Phase phase) const {
+    uint32_t most = 0;
+    for (unsigned int i = 0; i < count[phase]; i++){
+        if (samples[phase][i] > most){
+            most = samples[phase][i];
+        }
+    }
+    return most / 1000.0;
+}
+
+}
+
+}
@@ -0,0 +1,88 @@
+#ifndef _dodgeball_profile_h
+#define _dodgeball_profile_h
+
+#include <stdint.h>
+
+#include "clock.h"
+
+/* Build with DODGEBALL_PROFILE defined (scons profile=1) to
+ * time the phases of a tick and of a draw. Without it PROFILE() expands to
+ * nothing and there is no cost at all.
+ */
+
+namespace Dodgeball{
+
+namespace Profile{
+
+enum Phase{
+    Input,
+    Team1,
+    Team2,
+    Physics,
+    AfterPhysics,
+    Balls,
+    Collision,
+    FloatingText,
+    RemoveDead,
+    Camera,
+    DrawField,
+    DrawDrawables,
+    DrawOverlay,
+    Phases
+};
+
+const char * name(Phase phase);
+
+/* The last few samples of every phase, one sample each time the phase
+ * runs. Every World has its own so worlds on different threads don't share.
+ */
+class Times{
+public:
+    Times();
+
+    static const int history = 64;
+
+    void add(Phase phase, uint64_t nanoseconds);
+
+    /* microseconds over the samples kept */
+    double average(Phase phase) const;
+    double worst(Phase phase) const;
+
+protected:
+    uint32_t samples[Phases][history];
+    unsigned int next[Phases];
+    unsigned int count[Phases];
+};
+
+class ScopedTimer{
+public:
+    ScopedTimer(Times & times, Phase phase):
+    times(times),
+    phase(phase),
+    start(currentNanoseconds()){
+    }
+
+    ~ScopedTimer(){
+        times.add(phase, currentNanoseconds() - start);
+    }
+
+protected:
+    Times & times;
+    const Phase phase;
+    const uint64_t start;
+};
+
+}
+
+}
+
+#ifdef DODGEBALL_PROFILE
+#define PROFILE_JOIN2(a, b) a##b
+#define PROFILE_JOIN(a, b) PROFILE_JOIN2(a, b)
+/* times the rest of the enclosing scope */
+#define PROFILE(times, phase) Dodgeball::Profile::ScopedTimer PROFILE_JOIN(profile, __LINE__)(times, Dodgeball::Profile::phase)
+#else
+#define PROFILE(times, phase)
+#endif
+
+#endif
@@ -0,0 +1,206 @@
+#include "replay.h"
+
+#include <fstream>
+#include <iterator>
+#include <string.h>
+
+using std::string;
+using std::vector;
+
+namespace Dodgeball{
+
+static const char magic[4] = {'D', 'B', 'R', 'P'};
+static const unsigned int version = 1;
+
+enum Flags{
+    HumanLeft = 1,
+    HumanRight = 2
+};
+
+ReplayException::ReplayException(const string & file, int line, const string & reason):
+Exception::Base(file, line),
+reason(reason){
+}
+
+ReplayException::ReplayException(const ReplayException & copy):
+Exception::Base(copy),
+reason(copy.reason){
+}
+
+ReplayException::~ReplayException() throw(){
+}
+
+Exception::Base * ReplayException::copy() const {
+    return new ReplayException(*this);
+}
+
+const string ReplayException::getReason() const {
+    return reason;
+}
+
+/* 7 bits at a time, low bits first, the high bit is set if more follow */
+static void writeVarint(vector<unsigned char> & out, unsigned int value){
+    while (value >= 0x80){
+        out.push_back((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(value);
+}
+
+ReplayRecorder::ReplayRecorder(const MatchSettings & settings):
+settings(settings),
+ticks(0),
+left(0),
+right(0),
+repeat(0){
+    /* most ticks don't write anything */
+    records.reserve(4096);
+}
+
+void ReplayRecorder::record(unsigned int left, unsigned int right){
+    ticks += 1;
+    if (left == this->left && right == this->right){
+        repeat += 1;
+        return;
+    }
+
+    writeVarint(records, repeat);
+    writeVarint(records, left ^ this->left);
+    writeVarint(records, right ^ this->right);
+    this->left = left;
+    this->right = right;
+    repeat = 0;
+}
+
+unsigned int ReplayRecorder::getTicks() const {
+    return ticks;
+}
+
+void ReplayRecorder::save(const string & path, uint32_t hash) const {
+    vector<unsigned char> out(magic, magic + sizeof(magic));
+    writeVarint(out, version);
+    writeVarint(out, settings.seed);
+    writeVarint(out, (settings.humanLeft ? HumanLeft : 0) | (settings.humanRight ? HumanRight : 0));
+    writeVarint(out, settings.players);
+    writeVarint(out, settings.balls);
+    writeVarint(out, ticks);
+    writeVarint(out, hash);
+
+    out.insert(out.end(), records.begin(), records.end());
+    /* the last tick is written as a change of nothing */
+    if (repeat > 0){
+        writeVarint(out, repeat - 1);
+        writeVarint(out, 0);
+        writeVarint(out, 0);
+    }
+
+    std::ofstream file(path.c_str(), std::ios::out | std::ios::binary);
+    if (!file){
+        throw ReplayException(__FILE__, __LINE__, "Could not write replay " + path);
+    }
+    file.write((const char *) &out[0], out.size());
+}
+
+ReplayPlayer::ReplayPlayer(const string & path):
+position(0),
+seed(0),
+flags(0),
+players(0),
+balls(0),
+ticks(0),
+hash(0),
+played(0),
+left(0),
+right(0),
+repeat(0),
+change(false),
+leftChange(0),
+rightChange(0){
+    std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+    if (!file){
+        throw ReplayException(__FILE__, __LINE__, "Could not read replay " + path);
+    }
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+    if (data.size() < sizeof(magic) || memcmp(&data[0], magic, sizeof(magic)) != 0){
+        throw ReplayException(__FILE__, __LINE__, path + " is not a replay");
+    }
+    position = sizeof(magic);
+
+    if (read() != version){
+        throw ReplayException(__FILE__, __LINE__, path + " is from a different version");
+    }
+
+    seed = read();
+    flags = read();
+    players = read();
+    balls = read();
+    ticks = read();
+    hash = read();
+}
+
+unsigned int ReplayPlayer::read(){
+    unsigned int value = 0;
+    int shift = 0;
+    while (true){
+        if (position >= data.size() || shift > 28){
+            throw ReplayException(__FILE__, __LINE__, "Replay is truncated");
+        }
+        unsigned char byte = data[position];
+        position += 1;
+        value |= (unsigned int) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0){
+            return value;
+        }
+        shift += 7;
+    }
+}
+
+MatchSettings ReplayPlayer::getSettings() const {
+    MatchSettings settings(seed);
+    settings.humanLeft = (flags & HumanLeft) != 0;
+    settings.humanRight = (flags & HumanRight) != 0;
+    settings.players = players;
+    settings.balls = balls;
+    return settings;
+}
+
+unsigned int ReplayPlayer::getTicks() const {
+    return ticks;
+}
+
+uint32_t ReplayPlayer::getHash() const {
+    return hash;
+}
+
+unsigned int ReplayPlayer::getBytes() const {
+    return data.size();
+}
+
+bool ReplayPlayer::next(unsigned int & left, unsigned int & right){
+    if (played >= ticks){
+        return false;
+    }
+
+    if (repeat == 0 && !change){
+        repeat = read();
+        leftChange = read();
+        rightChange = read();
+        change = true;
+    }
+
+    if (repeat > 0){
+        repeat -= 1;
+    } else {
+        this->left ^= leftChange;
+        this->right ^= rightChange;
+        change = false;
+    }
+
+    played += 1;
+    left = this->left;
+    right = this->right;
+    return true;
+}
+
+}
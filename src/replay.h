@@ -0,0 +1,99 @@
+#ifndef _dodgeball_replay_h
+#define _dodgeball_replay_h
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "util/exceptions/exception.h"
+#include "world.h"
+
+namespace Dodgeball{
+
+class ReplayException: public Exception::Base {
+public:
+    ReplayException(const std::string & file, int line, const std::string & reason);
+    ReplayException(const ReplayException & copy);
+    virtual ~ReplayException() throw();
+
+    virtual void throwSelf() const {
+        throw *this;
+    }
+
+    virtual Exception::Base * copy() const;
+
+protected:
+    virtual const std::string getReason() const;
+
+    std::string reason;
+};
+
+/* A replay is the match settings followed by the Controls buttons of both
+ * teams for every tick. Buttons rarely change so each record says how many
+ * ticks repeat the previous buttons and then how the buttons change, as
+ * xors, all written as varints. A whole match is a few kilobytes.
+ */
+class ReplayRecorder{
+public:
+    ReplayRecorder(const MatchSettings & settings);
+
+    void record(unsigned int left, unsigned int right);
+
+    unsigned int getTicks() const;
+
+    /* hash is World::hash() after the last tick so playback can check that
+     * it ended up in the same place
+     */
+    void save(const std::string & path, uint32_t hash) const;
+
+protected:
+    MatchSettings settings;
+    std::vector<unsigned char> records;
+    unsigned int ticks;
+    unsigned int left;
+    unsigned int right;
+    /* ticks since the last change that haven't been written yet */
+    unsigned int repeat;
+};
+
+class ReplayPlayer{
+public:
+    ReplayPlayer(const std::string & path);
+
+    /* animations and sounds are left to the caller */
+    MatchSettings getSettings() const;
+
+    unsigned int getTicks() const;
+    uint32_t getHash() const;
+    /* size of the file */
+    unsigned int getBytes() const;
+
+    /* buttons for the next tick, false once every tick has been played */
+    bool next(unsigned int & left, unsigned int & right);
+
+protected:
+    unsigned int read();
+
+    std::vector<unsigned char> data;
+    unsigned int position;
+
+    unsigned int seed;
+    unsigned int flags;
+    int players;
+    int balls;
+    unsigned int ticks;
+    uint32_t hash;
+
+    unsigned int played;
+    unsigned int left;
+    unsigned int right;
+    /* ticks left before the pending change */
+    unsigned int repeat;
+    bool change;
+    unsigned int leftChange;
+    unsigned int rightChange;
+};
+
+}
+
+#endif
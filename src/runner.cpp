@@ -0,0 +1,180 @@
+#include "util/thread.h"
+#include "util/debug.h"
+#include "util/exceptions/exception.h"
+
+#include "runner.h"
+#include "clock.h"
+
+#include <iostream>
+#include <iomanip>
+
+using std::vector;
+
+namespace Dodgeball{
+
+MatchResult::MatchResult():
+seed(0),
+winner(None),
+ticks(0),
+hits(0),
+seconds(0){
+}
+
+MatchResult::Winner matchWinner(const World & world){
+    if (world.team1.mainPlayers() == 0 && world.team2.mainPlayers() == 0){
+        return MatchResult::Draw;
+    }
+    if (world.team2.mainPlayers() == 0){
+        return MatchResult::Left;
+    }
+    if (world.team1.mainPlayers() == 0){
+        return MatchResult::Right;
+    }
+    return MatchResult::None;
+}
+
+const char * winnerName(MatchResult::Winner winner){
+    switch (winner){
+        case MatchResult::Left: return "left";
+        case MatchResult::Right: return "right";
+        case MatchResult::Draw: return "draw";
+        case MatchResult::None: return "none";
+    }
+    return "none";
+}
+
+MatchRunner::MatchRunner(const MatchSettings & settings, unsigned int matches, unsigned int threads, unsigned int maxTicks):
+settings(settings),
+matches(matches),
+threads(threads < 1 ? 1 : threads),
+maxTicks(maxTicks),
+next(0),
+nextManager(0),
+results(matches),
+seconds(0),
+pack(AssetPack::instance()){
+}
+
+MatchResult MatchRunner::play(unsigned int match, const Util::ReferenceCount<AnimationManager> & animations, const Util::ReferenceCount<SoundManager> & sounds){
+    MatchSettings use(settings);
+    use.seed = settings.seed + match;
+    use.humanLeft = false;
+    use.humanRight = false;
+    /* the worker's own managers, the shared instance() isn't thread safe */
+    use.animations = animations;
+    use.sounds = sounds;
+
+    World world(use);
+
+    MatchResult result;
+    result.seed = use.seed;
+    double start = currentSeconds();
+    while (result.ticks < maxTicks && !world.isDone()){
+        world.run();
+        result.ticks += 1;
+    }
+    result.seconds = currentSeconds() - start;
+    result.winner = matchWinner(world);
+    result.hits = world.getHits();
+    return result;
+}
+
+/* the animations are loaded once per thread and reused by every match this thread plays */
+void MatchRunner::work(const Util::ReferenceCount<AnimationManager> & animations){
+    Util::ReferenceCount<SoundManager> sounds = SoundManager::silent();
+
+    while (true){
+        unsigned int match = __sync_fetch_and_add(&next, 1);
+        if (match >= matches){
+            break;
+        }
+        try{
+            results[match] = play(match, animations, sounds);
+        } catch (const Exception::Base & fail){
+            Global::debug(0) << "Match " << match << " failed: " << fail.getTrace() << std::endl;
+            results[match].seed = settings.seed + match;
+        }
+    }
+}
+
+void * MatchRunner::worker(void * self){
+    MatchRunner * runner = (MatchRunner*) self;
+    unsigned int slot = __sync_fetch_and_add(&runner->nextManager, 1);
+    runner->work(runner->managers[slot]);
+    return NULL;
+}
+
+void MatchRunner::run(){
+    next = 0;
+    /* the calling thread takes the first */
+    nextManager = 1;
+    managers.clear();
+    for (unsigned int i = 0; i < threads; i++){
+        Util::ReferenceCount<AnimationManager> animations(new AnimationManager(pack.raw()));
+        animations->getSet(Player::character);
+        managers.push_back(animations);
+    }
+
+    double start = currentSeconds();
+
+    /* the calling thread is one of the workers */
+    vector<Util::Thread::Id> ids;
+    for (unsigned int i = 1; i < threads; i++){
+        Util::Thread::Id id;
+        if (Util::Thread::createThread(&id, NULL, (Util::Thread::ThreadFunction) worker, this)){
+            ids.push_back(id);
+        } else {
+            Global::debug(0) << "Could not start worker thread " << i << std::endl;
+        }
+    }
+
+    work(managers[0]);
+
+    for (vector<Util::Thread::Id>::iterator it = ids.begin(); it != ids.end(); it++){
+        Util::Thread::joinThread(*it);
+    }
+
+    seconds = currentSeconds() - start;
+}
+
+const vector<MatchResult> & MatchRunner::getResults() const {
+    return results;
+}
+
+double MatchRunner::getSeconds() const {
+    return seconds;
+}
+
+void MatchRunner::report(std::ostream & out) const {
+    unsigned int wins[4] = {0, 0, 0, 0};
+    unsigned long long ticks = 0;
+    unsigned long long hits = 0;
+    double busy = 0;
+    for (vector<MatchResult>::const_iterator it = results.begin(); it != results.end(); it++){
+        const MatchResult & result = *it;
+        wins[result.winner] += 1;
+        ticks += result.ticks;
+        hits += result.hits;
+        busy += result.seconds;
+    }
+
+    out << "matches " << matches << std::endl;
+    out << "threads " << threads << std::endl;
+    out << "left " << wins[MatchResult::Left] << std::endl;
+    out << "right " << wins[MatchResult::Right] << std::endl;
+    out << "draw " << wins[MatchResult::Draw] << std::endl;
+    out << "unfinished " << wins[MatchResult::None] << std::endl;
+    out << "ticks " << ticks << std::endl;
+    out << "hits " << hits << std::endl;
+    out << "seconds " << seconds << std::endl;
+    if (seconds > 0){
+        out << "ticks/sec " << ticks / seconds << std::endl;
+        out << "ticks/sec/thread " << ticks / seconds / threads << std::endl;
+    }
+    /* time actually spent simulating, excludes loading and thread startup */
+    if (busy > 0){
+        out << "ticks/sec/core " << ticks / busy << std::endl;
+    }
+}
+
+}
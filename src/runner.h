@@ -0,0 +1,78 @@
+#ifndef _dodgeball_runner_h
+#define _dodgeball_runner_h
+
+#include <vector>
+#include <ostream>
+
+#include "world.h"
+
+namespace Dodgeball{
+
+struct MatchResult{
+    enum Winner{
+        None,
+        Left,
+        Right,
+        Draw
+    };
+
+    MatchResult();
+
+    unsigned int seed;
+    Winner winner;
+    unsigned int ticks;
+    unsigned int hits;
+    /* wall clock time spent stepping the world */
+    double seconds;
+};
+
+/* who won so far, None if the match is still going */
+MatchResult::Winner matchWinner(const World & world);
+const char * winnerName(MatchResult::Winner winner);
+
+/* Runs independent ai vs ai matches on a pool of threads. Match i uses the
+ * seed settings.seed + i so a run can be reproduced one match at a time.
+ * Global::initNoGraphics() and setHeadless(true) must be called first.
+ */
+class MatchRunner{
+public:
+    MatchRunner(const MatchSettings & settings, unsigned int matches, unsigned int threads, unsigned int maxTicks);
+
+    /* blocks until every match is finished */
+    void run();
+
+    const std::vector<MatchResult> & getResults() const;
+
+    /* wall clock time of the last run() */
+    double getSeconds() const;
+
+    void report(std::ostream & out) const;
+
+protected:
+    static void * worker(void * self);
+    void work(const Util::ReferenceCount<AnimationManager> & animations);
+    MatchResult play(unsigned int match, const Util::ReferenceCount<AnimationManager> & animations, const Util::ReferenceCount<SoundManager> & sounds);
+
+    const MatchSettings settings;
+    const unsigned int matches;
+    const unsigned int threads;
+    const unsigned int maxTicks;
+
+    /* next match to hand out, claimed atomically by the workers */
+    volatile unsigned int next;
+    /* Loaded on the calling thread before any worker starts, one per
+     * worker so nothing is shared. Loading uses Storage and the token
+     * reader, which are not safe to use from several threads at once.
+     */
+    std::vector<Util::ReferenceCount<AnimationManager> > managers;
+    volatile unsigned int nextManager;
+    /* one slot per match so the workers never write to the same element */
+    std::vector<MatchResult> results;
+    double seconds;
+    /* looked up here on the main thread, the workers only read it */
+    Util::ReferenceCount<AssetPack> pack;
+};
+
+}
+
+#endif
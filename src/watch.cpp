@@ -0,0 +1,93 @@
+#include "watch.h"
+
+#include "util/debug.h"
+
+#include <set>
+#include <unistd.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+using std::string;
+using std::vector;
+using std::map;
+
+namespace Dodgeball{
+
+FileWatcher::FileWatcher():
+descriptor(-1){
+#ifdef __linux__
+    descriptor = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (descriptor == -1){
+        Global::debug(0) << "Could not watch for file changes, inotify failed with " << errno << std::endl;
+    }
+#endif
+}
+
+FileWatcher::~FileWatcher(){
+    if (descriptor != -1){
+        close(descriptor);
+    }
+}
+
+string FileWatcher::join(const string & directory, const string & file){
+    if (directory.size() > 1 && directory[directory.size() - 1] == '/'){
+        return directory.substr(0, directory.size() - 1) + "/" + file;
+    }
+    return directory + "/" + file;
+}
+
+void FileWatcher::watch(const string & directory){
+#ifdef __linux__
+    if (descriptor == -1){
+        return;
+    }
+
+    /* Editors usually save by writing a new file and renaming it over the
+     * old one. Watching a directory again gives back the same descriptor.
+     */
+    int watched = inotify_add_watch(descriptor, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (watched == -1){
+        Global::debug(0) << "Could not watch " << directory << ", inotify failed with " << errno << std::endl;
+        return;
+    }
+    directories[watched] = directory;
+#endif
+}
+
+vector<string> FileWatcher::changed(){
+    vector<string> out;
+#ifdef __linux__
+    if (descriptor == -1){
+        return out;
+    }
+
+    std::set<string> seen;
+    /* aligned for the events that are read into it */
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    while (true){
+        ssize_t got = read(descriptor, buffer, sizeof(buffer));
+        if (got <= 0){
+            /* EAGAIN once there is nothing left */
+            break;
+        }
+
+        for (char * at = buffer; at < buffer + got; at += sizeof(struct inotify_event) + ((struct inotify_event*) at)->len){
+            const struct inotify_event * event = (const struct inotify_event*) at;
+            map<int, string>::iterator directory = directories.find(event->wd);
+            if (event->len == 0 || directory == directories.end()){
+                continue;
+            }
+            string path = join(directory->second, event->name);
+            if (seen.insert(path).second){
+                out.push_back(path);
+            }
+        }
+    }
+#endif
+    return out;
+}
+
+}
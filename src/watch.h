@@ -0,0 +1,35 @@
+#ifndef _dodgeball_watch_h
+#define _dodgeball_watch_h
+
+#include <string>
+#include <vector>
+#include <map>
+
+namespace Dodgeball{
+
+/* Tells which files in a set of directories were written since the last
+ * time it was asked. Uses inotify, so it never blocks and on anything but
+ * linux nothing ever changes.
+ */
+class FileWatcher{
+public:
+    FileWatcher();
+    virtual ~FileWatcher();
+
+    void watch(const std::string & directory);
+
+    /* full paths of the files written or moved into place, each only once */
+    std::vector<std::string> changed();
+
+    /* a file in a directory the way changed() names it */
+    static std::string join(const std::string & directory, const std::string & file);
+
+protected:
+    int descriptor;
+    /* watch descriptor to directory */
+    std::map<int, std::string> directories;
+};
+
+}
+
+#endif
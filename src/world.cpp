@@ -3,13 +3,22 @@
 #include "util/input/input-manager.h"
 #include "util/funcs.h"
 #include "util/font.h"
-#include "util/sound/sound.h"
 #include "util/tokenreader.h"
 #include "util/token.h"
+#include "util/debug.h"
+#include "util/exceptions/exception.h"
+#include "util/thread.h"
+#include "util/configuration.h"
 
 #include <map>
+#include <algorithm>
 #include <sstream>
 #include <math.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using std::vector;
 using std::string;
@@ -19,6 +28,61 @@ namespace Dodgeball{
 
 static const double gravity = 0.9;
 
+static bool headless = false;
+
+void setHeadless(bool what){
+    headless = what;
+}
+
+bool isHeadless(){
+    return headless;
+}
+
+Random::Random(unsigned int seed){
+    setSeed(seed);
+}
+
+void Random::setSeed(unsigned int seed){
+    /* splitmix the seed so that nearby seeds give unrelated sequences
+     * and the state is never 0, which xorshift can't get out of.
+     */
+    uint64_t mix = (uint64_t) seed + 0x9e3779b97f4a7c15ULL;
+    mix = (mix ^ (mix >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    mix = (mix ^ (mix >> 27)) * 0x94d049bb133111ebULL;
+    mix = mix ^ (mix >> 31);
+    state = mix != 0 ? mix : 1;
+}
+
+uint64_t Random::getState() const {
+    return state;
+}
+
+void Random::setState(uint64_t state){
+    this->state = state;
+}
+
+/* xorshift64* */
+unsigned int Random::next(){
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return (unsigned int) ((state * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+int Random::rnd(int q){
+    if (q <= 0){
+        return 0;
+    }
+    return (int) (next() % (unsigned int) q);
+}
+
+int Random::rnd(int q, int range){
+    if (q >= range){
+        return q;
+    }
+    return q + rnd(range - q);
+}
+
 Camera::Camera():
 x(0),
 y(0),
@@ -244,34 +308,20 @@ struct Hold{
     void act();
     void press();
     void release();
+
+    /* 3 ints, returns where the next value goes */
+    int * save(int * out) const;
+    const int * restore(const int * in);
 };
 
 class HumanBehavior: public Behavior {
 public:
-    enum Input{
-        Left,
-        Right,
-        Up,
-        Down,
-        Jump,
-        Catch,
-        Pass,
-        /* Either throw or pick up ball */
-        Action
-    };
-
-    HumanBehavior():
+    /* controls belong to the team and are updated every tick */
+    HumanBehavior(const Controls & controls):
+    controls(controls),
     control(false),
     runningLeft(false),
     runningRight(false){
-        map.set(Keyboard::Key_LEFT, Left);
-        map.set(Keyboard::Key_RIGHT, Right);
-        map.set(Keyboard::Key_UP, Up);
-        map.set(Keyboard::Key_DOWN, Down);
-        map.set(Keyboard::Key_A, Action);
-        map.set(Keyboard::Key_S, Catch);
-        map.set(Keyboard::Key_D, Pass);
-        map.set(Keyboard::Key_SPACE, Jump);
     }
     
     virtual void resetInput(){
@@ -288,104 +338,24 @@ public:
         if (control){
             doInput(world, player);
         } else {
-            Ball & ball = world.getBall();
+            Ball & ball = world.closestBall(player);
             player.faceTowards(ball.getX(), ball.getY());
         }
     }
 
     void doInput(World & world, Player & player){
-        class Handler: public InputHandler<Input> {
-        public:
-            Handler(HumanBehavior & human):
-            human(human),
-            action(false),
-            catching(false),
-            pass(false),
-            jump(false){
-            }
-
-            HumanBehavior & human;
-            bool action;
-            bool catching;
-            bool pass;
-            bool jump;
-
-            void press(const Input & out, Keyboard::unicode_t unicode){
-                switch (out){
-                    case Left: {
-                        human.left.press();
-                        break;
-                    }
-                    case Right: {
-                        human.right.press();
-                        break;
-                    }
-                    case Up: {
-                        human.up.press();
-                        break;
-                    }
-                    case Down: {
-                        human.down.press();
-                        break;
-                    }
-                    case Catch: {
-                        catching = true;
-                        break;
-                    }
-                    case Action: {
-                        action = true;
-                        break;
-                    }
-                    case Pass: {
-                        pass = true;
-                        break;
-                    }
-                    case Jump: {
-                        jump = true;
-                        break;
-                    }
-                    default: {
-                        break;
-                    }
-                }
-
-            }
-
-            void release(const Input & out, Keyboard::unicode_t unicode){
-                switch (out){
-                    case Left: {
-                        human.left.release();
-                        break;
-                    }
-                    case Right: {
-                        human.right.release();
-                        break;
-                    }
-                    case Up: {
-                        human.up.release();
-                        break;
-                    }
-                    case Down: {
-                        human.down.release();
-                        break;
-                    }
-                    default: {
-                        break;
-                    }
-                }
-            }
-        };
-
         left.act();
         right.act();
         up.act();
         down.act();
 
-        Handler handler(*this);
-        InputManager::handleEvents(map, InputSource(0, 0), handler);
+        update(left, Controls::Left);
+        update(right, Controls::Right);
+        update(up, Controls::Up);
+        update(down, Controls::Down);
 
         if (!player.isFalling() && player.getZ() <= 0){
-            if (handler.jump){
+            if (controls.wasPressed(Controls::Jump)){
                 runningLeft = false;
                 runningRight = false;
                 player.doJump();
@@ -481,14 +451,23 @@ public:
             }
         }
 
-        if (handler.action){
+        if (controls.wasPressed(Controls::Action)){
             player.doAction(world);
-        } else if (handler.catching){
+        } else if (controls.wasPressed(Controls::Catch)){
             player.doCatch();
-        } else if (handler.pass && player.hasBall()){
+        } else if (controls.wasPressed(Controls::Pass) && player.hasBall()){
             player.doPass(world);
         }
     }
+
+    void update(Hold & hold, Controls::Button button){
+        if (controls.wasPressed(button)){
+            hold.press();
+        }
+        if (controls.wasReleased(button)){
+            hold.release();
+        }
+    }
     
     void setControl(bool what){
         this->control = what;
@@ -497,8 +476,30 @@ public:
     bool hasControl() const {
         return this->control;
     }
+
+    void save(State & state) const {
+        int * out = state.values;
+        *out++ = control;
+        *out++ = runningLeft;
+        *out++ = runningRight;
+        out = left.save(out);
+        out = right.save(out);
+        out = up.save(out);
+        out = down.save(out);
+    }
+
+    void restore(const State & state){
+        const int * in = state.values;
+        control = *in++;
+        runningLeft = *in++;
+        runningRight = *in++;
+        in = left.restore(in);
+        in = right.restore(in);
+        in = up.restore(in);
+        in = down.restore(in);
+    }
     
-    InputMap<Input> map;
+    const Controls & controls;
     bool control;
 
     Hold left;
@@ -521,6 +522,12 @@ public:
     bool hasControl() const {
         return false;
     }
+
+    void save(State & state) const {
+    }
+
+    void restore(const State & state){
+    }
 };
 
 static bool insideBox(double x, double y, const Box & box){
@@ -560,7 +567,7 @@ public:
      * pick up the ball.
      */
     void act(World & world, Player & player){
-        Ball & ball = world.getBall();
+        Ball & ball = world.closestBall(player);
 
         player.faceTowards(ball.getX(), ball.getY());
 
@@ -586,11 +593,12 @@ public:
                     if (player.onSideline() && Util::distance(player.getX(), player.getY(), sidelineX, sidelineY) > player.walkingSpeed()){
                         moveTowards(player, sidelineX, sidelineY);
                     } else {
-                        if (wantX == 0 || wantY == 0 || Util::rnd(200) == 0){
-                            wantX = Util::rnd(player.getLimit().x1, player.getLimit().x2);
-                            wantY = Util::rnd(player.getLimit().y1, player.getLimit().y2);
+                        Random & random = world.getRandom();
+                        if (wantX == 0 || wantY == 0 || random.rnd(200) == 0){
+                            wantX = random.rnd(player.getLimit().x1, player.getLimit().x2);
+                            wantY = random.rnd(player.getLimit().y1, player.getLimit().y2);
                             want = true;
-                        } else if (Util::rnd(120) == 0){
+                        } else if (random.rnd(120) == 0){
                             player.doCatch();
                         }
                         if (want && Util::distance(player.getX(), player.getY(), wantX, wantY) > player.walkingSpeed()){
@@ -618,10 +626,24 @@ public:
     bool hasControl() const {
         return true;
     }
+
+    void save(State & state) const {
+        state.values[0] = wait;
+        state.values[1] = wantX;
+        state.values[2] = wantY;
+        state.values[3] = want;
+    }
+
+    void restore(const State & state){
+        wait = state.values[0];
+        wantX = state.values[1];
+        wantY = state.values[2];
+        want = state.values[3];
+    }
 };
 
-static string randomName(){
-    switch (Util::rnd(10)){
+static string randomName(Random & random){
+    switch (random.rnd(10)){
         case 0: return "Bob";
         case 1: return "Randy";
         case 2: return "Sam";
@@ -636,15 +658,170 @@ static string randomName(){
     return "Guy";
 }
 
-Player::Player(double x, double y, const Graphics::Color & color, const Box & box, const Util::ReferenceCount<Behavior> & behavior, bool sideline, double health):
-x(x),
-y(y),
-z(0),
-velocityX(0),
-velocityY(0),
-velocityZ(0),
+Bodies::Bodies(){
+}
+
+unsigned int Bodies::add(double x, double y){
+    unsigned int index;
+    if (unused.size() > 0){
+        index = unused.back();
+        unused.pop_back();
+    } else {
+        index = size();
+        this->x.push_back(0);
+        this->y.push_back(0);
+        z.push_back(0);
+        velocityX.push_back(0);
+        velocityY.push_back(0);
+        velocityZ.push_back(0);
+        oldZ.push_back(0);
+        ground.push_back(1);
+    }
+
+    this->x[index] = x;
+    this->y[index] = y;
+    z[index] = 0;
+    velocityX[index] = 0;
+    velocityY[index] = 0;
+    velocityZ[index] = 0;
+    oldZ[index] = 0;
+    ground[index] = 1;
+
+    return index;
+}
+
+void Bodies::remove(unsigned int index){
+    /* a dead body still gets integrated until the slot is reused, make sure
+     * it stays put
+     */
+    z[index] = 0;
+    velocityX[index] = 0;
+    velocityY[index] = 0;
+    velocityZ[index] = 0;
+    unused.push_back(index);
+}
+
+unsigned int Bodies::size() const {
+    return x.size();
+}
+
+/* vector assignment reuses the existing storage when it is big enough */
+void Bodies::save(Bodies & out) const {
+    out.x = x;
+    out.y = y;
+    out.z = z;
+    out.velocityX = velocityX;
+    out.velocityY = velocityY;
+    out.velocityZ = velocityZ;
+    out.oldZ = oldZ;
+    out.ground = ground;
+}
+
+void Bodies::restore(const Bodies & from){
+    x = from.x;
+    y = from.y;
+    z = from.z;
+    velocityX = from.velocityX;
+    velocityY = from.velocityY;
+    velocityZ = from.velocityZ;
+    oldZ = from.oldZ;
+    ground = from.ground;
+}
+
+/* The same as
+ *   if (v > friction) v -= friction
+ *   else if (v < -friction) v += friction
+ *   else v = 0
+ * but without branches
+ */
+static inline double applyFriction(double velocity, double friction){
+    double clamped = velocity < -friction ? -friction : (velocity > friction ? friction : velocity);
+    return velocity - clamped;
+}
+
+void Bodies::integrate(double gravity, double friction){
+    const unsigned int count = size();
+    if (count == 0){
+        return;
+    }
+
+    double * x = &this->x[0];
+    double * y = &this->y[0];
+    double * z = &this->z[0];
+    double * velocityX = &this->velocityX[0];
+    double * velocityY = &this->velocityY[0];
+    double * velocityZ = &this->velocityZ[0];
+    double * oldZ = &this->oldZ[0];
+    unsigned char * ground = &this->ground[0];
+
+    unsigned int i = 0;
+
+#ifdef __SSE2__
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d fall = _mm_set1_pd(gravity);
+    const __m128d high = _mm_set1_pd(friction);
+    const __m128d low = _mm_set1_pd(-friction);
+    for (/**/; i + 2 <= count; i += 2){
+        __m128d pz = _mm_loadu_pd(z + i);
+        __m128d vx = _mm_loadu_pd(velocityX + i);
+        __m128d vy = _mm_loadu_pd(velocityY + i);
+        __m128d vz = _mm_loadu_pd(velocityZ + i);
+
+        /* all bits set for bodies that are in the air */
+        __m128d air = _mm_cmpgt_pd(pz, zero);
+
+        /* in the air gravity pulls down, on the ground z and vz become 0 */
+        vz = _mm_and_pd(air, _mm_sub_pd(vz, fall));
+        pz = _mm_and_pd(air, pz);
+
+        __m128d fx = _mm_sub_pd(vx, _mm_max_pd(low, _mm_min_pd(high, vx)));
+        __m128d fy = _mm_sub_pd(vy, _mm_max_pd(low, _mm_min_pd(high, vy)));
+        vx = _mm_or_pd(_mm_and_pd(air, vx), _mm_andnot_pd(air, fx));
+        vy = _mm_or_pd(_mm_and_pd(air, vy), _mm_andnot_pd(air, fy));
+
+        _mm_storeu_pd(oldZ + i, pz);
+        _mm_storeu_pd(velocityX + i, vx);
+        _mm_storeu_pd(velocityY + i, vy);
+        _mm_storeu_pd(velocityZ + i, vz);
+        _mm_storeu_pd(x + i, _mm_add_pd(_mm_loadu_pd(x + i), vx));
+        _mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), vy));
+        _mm_storeu_pd(z + i, _mm_add_pd(pz, vz));
+
+        int mask = _mm_movemask_pd(air);
+        ground[i] = (mask & 1) == 0;
+        ground[i + 1] = (mask & 2) == 0;
+    }
+#endif
+
+    for (/**/; i < count; i++){
+        if (z[i] > 0){
+            velocityZ[i] -= gravity;
+            ground[i] = 0;
+        } else {
+            z[i] = 0;
+            velocityZ[i] = 0;
+            velocityX[i] = applyFriction(velocityX[i], friction);
+            velocityY[i] = applyFriction(velocityY[i], friction);
+            ground[i] = 1;
+        }
+
+        oldZ[i] = z[i];
+        x[i] += velocityX[i];
+        y[i] += velocityY[i];
+        z[i] += velocityZ[i];
+    }
+}
+
+const char * const Player::character = "alex";
+
+Player::Player(Bodies & bodies, AnimationManager & animations, const unsigned int & clock, double x, double y, const Graphics::Color & color, const Box & box, const Util::ReferenceCount<Behavior> & behavior, bool sideline, double health, const string & name):
+bodies(&bodies),
+body(bodies.add(x, y)),
+animations(&animations.getSet(character)),
+clock(&clock),
 health(health),
-hasBall_(false),
+name(name),
+held(NULL),
 facing(FaceRight),
 limit(box),
 color(color),
@@ -655,9 +832,55 @@ forceMove(false),
 wantX(0),
 wantY(0),
 falling(0),
-behavior(behavior),
-animation(getAnimation("idle")){
-    name = randomName();
+behavior(behavior){
+    setIdleAnimation();
+}
+
+Player::~Player(){
+    bodies->remove(body);
+}
+
+Player::State::State():
+health(0),
+held(NULL),
+facing(FaceRight),
+backToIdle(false),
+sideline(false),
+catching(0),
+forceMove(false),
+wantX(0),
+wantY(0),
+falling(0){
+}
+
+void Player::save(State & state) const {
+    state.health = health;
+    state.held = held;
+    state.facing = facing;
+    state.backToIdle = backToIdle;
+    state.sideline = sideline;
+    state.catching = catching;
+    state.forceMove = forceMove;
+    state.wantX = wantX;
+    state.wantY = wantY;
+    state.falling = falling;
+    state.animation = animation;
+    behavior->save(state.behavior);
+}
+
+void Player::restore(const State & state){
+    health = state.health;
+    held = state.held;
+    facing = state.facing;
+    backToIdle = state.backToIdle;
+    sideline = state.sideline;
+    catching = state.catching;
+    forceMove = state.forceMove;
+    wantX = state.wantX;
+    wantY = state.wantY;
+    falling = state.falling;
+    animation = state.animation;
+    behavior->restore(state.behavior);
 }
 
 const string & Player::getName() const {
@@ -680,12 +903,16 @@ bool Player::isCatching() const {
     return catching > 0;
 }
 
+const Animation * Player::getPlaying() const {
+    return animation.definition;
+}
+
 bool Player::onSideline() const {
     return sideline;
 }
 
 bool Player::hasBall() const {
-    return hasBall_;
+    return held != NULL;
 }
     
 void Player::faceTowards(double x, double y){
@@ -744,9 +971,9 @@ void Player::doPass(World & world){
                          << " time " << time << " vx " << vx << " vy " << vy << " vz " << vz << std::endl;
          */
 
-        world.getBall().doPass(world, *this, vx, vy, vz);
+        held->doPass(world, *this, vx, vy, vz);
 
-        hasBall_ = false;
+        held = NULL;
         /* attempt to catch while the ball is in the air */
         target->doCatch(time + 5);
         world.giveControl(target);
@@ -765,17 +992,15 @@ double Player::walkingSpeed() const {
     return 4.5;
 }
 
-void Player::dropBall(Ball & ball){
+void Player::dropBall(){
     if (hasBall()){
-        hasBall_ = false;
-        ball.ungrab();
+        held->ungrab();
+        held = NULL;
     }
 }
 
 void Player::act(World & world){
-    animation->act();
-
-    if (backToIdle && animation->isDone()){
+    if (backToIdle && animation.isDone(*clock)){
         backToIdle = false;
         setIdleAnimation();
     }
@@ -790,7 +1015,7 @@ void Player::act(World & world){
 
     if (forceMove && onGround()){
         if (hasBall()){
-            dropBall(world.getBall());
+            dropBall();
         }
 
         if (Util::distance(getX(), getY(), wantX, wantY) < 3){
@@ -798,8 +1023,8 @@ void Player::act(World & world){
             behavior->resetInput();
         } else {
             double angle = atan2(wantY - getY(), wantX - getX());
-            velocityX = cos(angle) * walkingSpeed();
-            velocityY = sin(angle) * walkingSpeed();
+            setVelocityX(cos(angle) * walkingSpeed());
+            setVelocityY(sin(angle) * walkingSpeed());
             setWalkingAnimation();
             if (wantX < getX()){
                 setFacing(FaceLeft);
@@ -808,17 +1033,15 @@ void Player::act(World & world){
             }
         }
     } else {
-        if (catching == 0 && falling == 0 && *animation != *getAnimation("rise")){
+        if (catching == 0 && falling == 0 && !animation.isPlaying(getAnimation(AnimationSet::Rise))){
             behavior->act(world, *this);
         }
     }
+}
 
-    if (z > 0){
-        velocityZ -= gravity;
-    } else {
-        z = 0;
-        velocityZ = 0;
-
+/* Gravity, friction and movement were already applied by Bodies::integrate */
+void Player::afterPhysics(World & world){
+    if (bodies->ground[body]){
         if (falling > 0){
             falling -= 1;
             if (falling == 0){
@@ -826,35 +1049,12 @@ void Player::act(World & world){
             }
         }
 
-        const Field & field = world.getField();
-        if (velocityX > field.getFriction()){
-            velocityX -= field.getFriction();
-        } else if (velocityX < -field.getFriction()){
-            velocityX += field.getFriction();
-        } else {
-            velocityX = 0;
-        }
-
-        if (velocityY > field.getFriction()){
-            velocityY -= field.getFriction();
-        } else if (velocityY < -field.getFriction()){
-            velocityY += field.getFriction();
-        } else {
-            velocityY = 0;
-        }
-        
-        if (velocityX == 0 && velocityY == 0 && falling == 0 && !backToIdle && !isCatching()){
+        if (bodies->velocityX[body] == 0 && bodies->velocityY[body] == 0 && falling == 0 && !backToIdle && !isCatching()){
             setIdleAnimation();
         }
     }
 
-    x += velocityX;
-    y += velocityY;
-
-    double oldZ = z;
-    z += velocityZ;
-
-    if (falling == 0 && oldZ > 0 && z <= 0){
+    if (falling == 0 && bodies->oldZ[body] > 0 && getZ() <= 0){
         setIdleAnimation();
     }
 
@@ -908,29 +1108,31 @@ void Player::act(World & world){
 }
 
 void Player::setPainAnimation(){
-    animation = getAnimation("pain");
+    getAnimation(AnimationSet::Pain).start(animation, *clock);
     backToIdle = true;
 }
 
 void Player::setFallAnimation(){
-    animation = getAnimation("fall");
+    getAnimation(AnimationSet::Fall).start(animation, *clock);
     backToIdle = false;
 }
 
 void Player::collided(Ball & ball, int damage){
+    /* with more than one ball in play a player can be hit while holding one */
+    dropBall();
     setFallAnimation();
     catching = 0;
     falling = 40;
-    velocityX = 8;
+    bodies->velocityX[body] = 8;
     if (!onSideline()){
         health -= damage;
     }
     if (ball.getVelocityX() < 0){
-        velocityX *= -1;
+        bodies->velocityX[body] *= -1;
     }
-    velocityY = 0;
-    velocityZ = 9;
-    z = 0.1;
+    bodies->velocityY[body] = 0;
+    bodies->velocityZ[body] = 9;
+    bodies->z[body] = 0.1;
 }
     
 double Player::getWidth() const {
@@ -959,11 +1161,11 @@ void Player::setControl(bool what){
 }
     
 void Player::setVelocityX(double x){
-    this->velocityX = x;
+    bodies->velocityX[body] = x;
 }
 
 void Player::setVelocityY(double y){
-    this->velocityY = y;
+    bodies->velocityY[body] = y;
 }
     
 bool Player::hasControl() const {
@@ -980,6 +1182,72 @@ Box Player::collisionBox() const {
     return Box(0, 0, width, height);
 }
 
+Controls::Controls():
+held(0),
+pressed(0),
+released(0){
+}
+
+void Controls::update(unsigned int buttons){
+    pressed = buttons & ~held;
+    released = held & ~buttons;
+    held = buttons;
+}
+
+bool Controls::isHeld(Button button) const {
+    return (held & button) != 0;
+}
+
+bool Controls::wasPressed(Button button) const {
+    return (pressed & button) != 0;
+}
+
+bool Controls::wasReleased(Button button) const {
+    return (released & button) != 0;
+}
+
+KeyboardControls::KeyboardControls():
+held(0){
+    map.set(Keyboard::Key_LEFT, Controls::Left);
+    map.set(Keyboard::Key_RIGHT, Controls::Right);
+    map.set(Keyboard::Key_UP, Controls::Up);
+    map.set(Keyboard::Key_DOWN, Controls::Down);
+    map.set(Keyboard::Key_A, Controls::Action);
+    map.set(Keyboard::Key_S, Controls::Catch);
+    map.set(Keyboard::Key_D, Controls::Pass);
+    map.set(Keyboard::Key_SPACE, Controls::Jump);
+    map.set(Keyboard::Key_Q, Controls::Cycle);
+}
+
+unsigned int KeyboardControls::poll(){
+    class Handler: public InputHandler<Controls::Button> {
+    public:
+        Handler(unsigned int held):
+        held(held),
+        tapped(0){
+        }
+
+        unsigned int held;
+        unsigned int tapped;
+
+        void press(const Controls::Button & out, Keyboard::unicode_t unicode){
+            held |= out;
+            tapped |= out;
+        }
+
+        void release(const Controls::Button & out, Keyboard::unicode_t unicode){
+            held &= ~out;
+        }
+    };
+
+    Handler handler(held);
+    InputManager::handleEvents(map, InputSource(0, 0), handler);
+    held = handler.held;
+
+    /* a key pressed and released within one tick still counts */
+    return held | handler.tapped;
+}
+
 void Hold::act(){
     if (time > 0){
         time -= 1;
@@ -1012,26 +1280,40 @@ void Hold::release(){
     last = Release;
 }
 
+int * Hold::save(int * out) const {
+    out[0] = count;
+    out[1] = time;
+    out[2] = last;
+    return out + 3;
+}
+
+const int * Hold::restore(const int * in){
+    count = in[0];
+    time = in[1];
+    last = (Last) in[2];
+    return in + 3;
+}
+
 
 void Player::doJump(){
-    animation = getAnimation("jump");
-    velocityZ = jumpVelocity;
+    getAnimation(AnimationSet::Jump).start(animation, *clock);
+    bodies->velocityZ[body] = jumpVelocity;
     /* set the z to some initial value above 0 so that it doesn't look like we
      * are hitting the ground.
      */
-    z = 0.1;
+    bodies->z[body] = 0.1;
 }
 
 double findAngle(double x1, double y1, double x2, double y2){
     return atan2(y2 - y1, x2 - x1);
 }
 
-Util::ReferenceCount<Animation> Player::getAnimation(const string & what){
-    return AnimationManager::instance()->getAnimation("alex", what)->clone();
+const Animation & Player::getAnimation(AnimationSet::Name what) const {
+    return animations->get(what);
 }
 
 void Player::setThrowAnimation(){
-    animation = getAnimation("punch");
+    getAnimation(AnimationSet::Punch).start(animation, *clock);
     backToIdle = true;
 }
 
@@ -1040,12 +1322,17 @@ void Player::throwBall(World & world, Ball & ball){
     Util::ReferenceCount<Player> enemy = world.getTarget(*this);
     world.giveControl(enemy);
 
-    double angle = findAngle(getX(), getY(), enemy->getX() + Util::rnd(-5, 5), enemy->getY() + Util::rnd(-5, 5));
+    /* roll the jitter in a fixed order so the throw is reproducible */
+    double jitterX = world.getRandom().rnd(-5, 5);
+    double jitterY = world.getRandom().rnd(-5, 5);
+    double angle = findAngle(getX(), getY(), enemy->getX() + jitterX, enemy->getY() + jitterY);
 
+    double velocityX = bodies->velocityX[body];
+    double velocityY = bodies->velocityY[body];
     double speed = 9 + sqrt(velocityX * velocityX + velocityY * velocityY);
 
     double vz = 0;
-    if (z > 0){
+    if (getZ() > 0){
         /* distance = velocity * time
          * d = vt
          *
@@ -1072,7 +1359,7 @@ void Player::throwBall(World & world, Ball & ball){
 
         double ground = Util::distance(getX(), getY(), enemy->getX(), enemy->getY());
 
-        vz = -(getHandPosition() + Util::rnd(-5, 5)) * speed / ground;
+        vz = -(getHandPosition() + world.getRandom().rnd(-5, 5)) * speed / ground;
     }
     
     Ball::Super super = Ball::None;
@@ -1086,11 +1373,11 @@ void Player::throwBall(World & world, Ball & ball){
     
     switch (super){
         case Ball::None: {
-            SoundManager::instance()->getSound(Filesystem::RelativePath("throw.wav"))->play();
+            world.playSound(World::ThrowSound);
             break;
         }
         default: {
-            SoundManager::instance()->getSound(Filesystem::RelativePath("super.wav"))->play();
+            world.playSound(World::SuperSound);
             break;
         }
     }
@@ -1100,8 +1387,7 @@ void Player::throwBall(World & world, Ball & ball){
     
 void Player::setCatchAnimation(){
     /* FIXME: bad animation here */
-    animation = getAnimation("upper-cut");
-    animation->setLoop(true);
+    getAnimation(AnimationSet::UpperCut).start(animation, *clock, true);
 }
     
 void Player::doCatch(int time){
@@ -1111,19 +1397,20 @@ void Player::doCatch(int time){
 
 void Player::doAction(World & world){
     if (hasBall()){
-        Ball & ball = world.getBall();
+        Ball & ball = *held;
         throwBall(world, ball);
-        hasBall_ = false;
+        held = NULL;
     } else {
-        if (world.getBall().getZ() < 1 &&
-            Util::distance(getX(), getY(), world.getBall().getX(), world.getBall().getY()) < 20){
-            grabBall(world.getBall());
+        Ball & ball = world.closestBall(*this);
+        if (ball.getZ() < 1 &&
+            Util::distance(getX(), getY(), ball.getX(), ball.getY()) < 20){
+            grabBall(ball);
         }
     }
 }
 
 void Player::setGrabAnimation(){
-    animation = getAnimation("get");
+    getAnimation(AnimationSet::Get).start(animation, *clock);
     backToIdle = true;
 }
 
@@ -1132,75 +1419,71 @@ void Player::grabBall(Ball & ball){
     setGrabAnimation();
     catching = 0;
     ball.grab(this);
-    hasBall_ = true;
+    held = &ball;
 }
 
 void Player::moveLeft(double speed){
     setWalkingAnimation();
-    this->velocityX = -speed;
-    // this->x -= speed;
+    bodies->velocityX[body] = -speed;
 }
 
 void Player::setWalkingAnimation(){
-    Util::ReferenceCount<Animation> walk = getAnimation("walk");
-    if (*animation != *walk){
-        animation = walk->clone();
-        animation->setLoop(true);
+    const Animation & walk = getAnimation(AnimationSet::Walk);
+    if (!animation.isPlaying(walk)){
+        walk.start(animation, *clock, true);
     }
 }
     
 void Player::setIdleAnimation(){
-    animation = getAnimation("idle");
+    getAnimation(AnimationSet::Idle).start(animation, *clock);
 }
     
 void Player::setRiseAnimation(){
-    animation = getAnimation("rise");
+    getAnimation(AnimationSet::Rise).start(animation, *clock);
     backToIdle = true;
 }
 
 void Player::setRunAnimation(){
-    Util::ReferenceCount<Animation> run = getAnimation("run");
-    if (*animation != *run){
-        animation = run->clone();
-        animation->setLoop(true);
+    const Animation & run = getAnimation(AnimationSet::Run);
+    if (!animation.isPlaying(run)){
+        run.start(animation, *clock, true);
     }
 }
 
 
 void Player::moveRight(double speed){
     setWalkingAnimation();
-    this->velocityX = speed;
-    // this->x += speed;
+    bodies->velocityX[body] = speed;
 }
     
 double Player::maxRunSpeed = 9;
     
 void Player::runRight(double speed){
     setRunAnimation();
-    this->velocityX += speed;
-    if (this->velocityX > maxRunSpeed){
-        this->velocityX = maxRunSpeed;
+    double & velocityX = bodies->velocityX[body];
+    velocityX += speed;
+    if (velocityX > maxRunSpeed){
+        velocityX = maxRunSpeed;
     }
 }
 
 void Player::runLeft(double speed){
     setRunAnimation();
-    this->velocityX -= speed;
-    if (this->velocityX < -maxRunSpeed){
-        this->velocityX = -maxRunSpeed;
+    double & velocityX = bodies->velocityX[body];
+    velocityX -= speed;
+    if (velocityX < -maxRunSpeed){
+        velocityX = -maxRunSpeed;
     }
 }
 
 void Player::moveUp(double speed){
     setWalkingAnimation();
-    this->velocityY = -speed;
-    // this->y -= speed;
+    bodies->velocityY[body] = -speed;
 }
 
 void Player::moveDown(double speed){
     setWalkingAnimation();
-    this->velocityY = speed;
-    // this->y += speed;
+    bodies->velocityY[body] = speed;
 }
 
 int Player::getFacingAngle() const {
@@ -1236,6 +1519,9 @@ bool Player::isFacingRight() const {
 void Player::draw(const Graphics::Bitmap & work, const Camera & camera){
     int width = getWidth();
     int height = getHeight();
+    double x = getX();
+    double y = getY();
+    double z = getZ();
     // work.ellipseFill((int) camera.computeX(x), (int) camera.computeY(y), 10, 5, Graphics::makeColor(32, 32, 32));
 
     /*
@@ -1269,7 +1555,7 @@ void Player::draw(const Graphics::Bitmap & work, const Camera & camera){
     work.circleFill((int) camera.computeX(x + 3), (int) camera.computeY(y - z - height * 3 / 4), 5, Graphics::makeColor(255, 255, 255));
     */
 
-    animation->draw(work, (int) camera.computeX(x), (int) camera.computeY(y - z), isFacingRight());
+    animation.draw(work, (int) camera.computeX(x), (int) camera.computeY(y - z), isFacingRight(), *clock);
 
     if (!onSideline()){
         const Font & font = Font::getDefaultFont(24, 24);
@@ -1278,30 +1564,32 @@ void Player::draw(const Graphics::Bitmap & work, const Camera & camera){
 }
 
 double Player::getX() const {
-    return x;
+    return bodies->x[body];
 }
     
 double Player::getZ() const {
-    return z;
+    return bodies->z[body];
 }
     
 double Player::getY() const {
-    return y;
+    return bodies->y[body];
 }
     
 void Player::setX(double x){
-    this->x = x;
+    bodies->x[body] = x;
 }
 
 void Player::setY(double y){
-    this->y = y;
+    bodies->y[body] = y;
 }
 
-Team::Team(Side side, const Field & field):
-side(side){
+Team::Team(Side side, World & world, bool human, int count):
+side(side),
+human(human),
+grid(world.getField()){
     switch (side){
-        case LeftSide: populateLeft(field); break;
-        case RightSide: populateRight(field); break;
+        case LeftSide: populateLeft(world, human, count); break;
+        case RightSide: populateRight(world, human, count); break;
     }
 }
     
@@ -1324,9 +1612,8 @@ void Team::removeDead(World & world){
         if (player->getHealth() > 0 || player->isDying()){
             it++;
         } else {
-            if (player->hasBall()){
-                player->dropBall(world.getBall());
-            }
+            player->dropBall();
+            world.removeDrawable(player.raw());
             it = players.erase(it);
         }
     }
@@ -1374,32 +1661,225 @@ static bool isFacing(double x1, double y1, double angle1, double x2, double y2){
     return dot > 0.1;
 }
 
-void Team::collisionDetection(World & world, Ball & ball){
+PlayerGrid::PlayerGrid(const Field & field):
+/* one extra cell on each side for the sideline players */
+columns(field.getWidth() / cellSize + 3),
+rows(field.getHeight() / cellSize + 3){
+    start.resize(columns * rows + 1);
+}
+
+int PlayerGrid::column(double x) const {
+    int column = (int) floor(x / cellSize) + 1;
+    if (column < 0){
+        return 0;
+    }
+    if (column >= columns){
+        return columns - 1;
+    }
+    return column;
+}
+
+int PlayerGrid::row(double y) const {
+    int row = (int) floor(y / cellSize) + 1;
+    if (row < 0){
+        return 0;
+    }
+    if (row >= rows){
+        return rows - 1;
+    }
+    return row;
+}
+
+/* counting sort of the players by cell so each cell is a contiguous run */
+void PlayerGrid::rebuild(const vector<Util::ReferenceCount<Player> > & players){
+    std::fill(start.begin(), start.end(), 0);
+    cells.resize(players.size());
+    entries.resize(players.size());
+
+    for (unsigned int i = 0; i < players.size(); i++){
+        const Util::ReferenceCount<Player> & player = players[i];
+        unsigned int cell = row(player->getY()) * columns + column(player->getX());
+        cells[i] = cell;
+        start[cell + 1] += 1;
+    }
+
+    for (unsigned int i = 1; i < start.size(); i++){
+        start[i] += start[i - 1];
+    }
+
+    /* fill each cell from the back so start[] ends up unchanged and the
+     * players in a cell stay in team order
+     */
+    for (unsigned int i = players.size(); i > 0; i--){
+        unsigned int cell = cells[i - 1];
+        unsigned int end = start[cell + 1] - 1;
+        entries[end] = i - 1;
+        start[cell + 1] = end;
+    }
+
+    /* start[cell + 1] is now the beginning of the cell, shift everything back */
+    for (unsigned int i = 0; i + 1 < start.size(); i++){
+        start[i] = start[i + 1];
+    }
+    start[start.size() - 1] = entries.size();
+}
+
+void PlayerGrid::query(double x1, double y1, double x2, double y2, vector<unsigned int> & out) const {
+    int column1 = column(x1);
+    int column2 = column(x2);
+    int row1 = row(y1);
+    int row2 = row(y2);
+    for (int row = row1; row <= row2; row++){
+        for (int column = column1; column <= column2; column++){
+            unsigned int cell = row * columns + column;
+            for (unsigned int i = start[cell]; i < start[cell + 1]; i++){
+                out.push_back(entries[i]);
+            }
+        }
+    }
+}
+
+void PlayerGrid::touching(double x1, double y1, double x2, double y2, vector<unsigned int> & out) const {
+    int column1 = column(x1);
+    int column2 = column(x2);
+    int row1 = row(y1);
+    int row2 = row(y2);
+    for (int row = row1; row <= row2; row++){
+        for (int column = column1; column <= column2; column++){
+            out.push_back(row * columns + column);
+        }
+    }
+}
+
+unsigned int PlayerGrid::first(unsigned int cell) const {
+    return start[cell];
+}
+
+unsigned int PlayerGrid::last(unsigned int cell) const {
+    return start[cell + 1];
+}
+
+unsigned int PlayerGrid::entry(unsigned int index) const {
+    return entries[index];
+}
+
+/* the same test the ball has always used against a single player */
+static bool touches(const Player & player, const Ball & ball, const Box & ballBox){
+    return fabs(player.getY() - ball.getY()) <= 8 &&
+           boxCollide(player.getX1(), player.getY1(), player.collisionBox(),
+                      ball.getX1(), ball.getY1(), ballBox);
+}
+
+int Team::findHit(const Ball & ball, bool useGrid){
     Box ballBox = ball.collisionBox();
-    for (vector<Util::ReferenceCount<Player> >::iterator it = players.begin(); it != players.end(); it++){
-        Util::ReferenceCount<Player> player = *it;
-        Box playerBox = player->collisionBox();
-        
-        if (fabs(player->getY() - ball.getY()) <= 8 &&
-            boxCollide(player->getX1(), player->getY1(), playerBox,
-                       ball.getX1(), ball.getY1(), ballBox)){
-
-            /* TODO: handle when the ball is in the air but the player didn't catch it.
-             * The ball should just bounce off of them without them taking damage
-             * but they should show a slight getting-hit animation.
-             */
-            if (player->isCatching() && isFacing(player->getX(), player->getY(), Util::radians(player->getFacingAngle()), ball.getX(), ball.getY())){
-                player->grabBall(ball);
-            } else if (ball.isThrown()){
-                SoundManager::instance()->getSound(Filesystem::RelativePath("beat1.wav"))->play();
-                int damage = ball.getPower();
-                player->collided(ball, damage);
-                ball.collided(*player);
-                world.addFloatingText(toString(damage), player->getX(), player->getY(), player->getZ() + 5);
+
+    if (!useGrid){
+        for (unsigned int i = 0; i < players.size(); i++){
+            if (touches(*players[i], ball, ballBox)){
+                return i;
             }
+        }
+        return -1;
+    }
 
-            /* cannot hit multiple players. TODO: some specials can hit multiple players */
-            break;
+    if (players.size() == 0){
+        return -1;
+    }
+
+    /* a player can only touch the ball if their feet are within 8 of the
+     * ball in y and within a player's width of it in x. the extra 1 covers
+     * boxCollide rounding to ints. findHits uses the same area.
+     */
+    double reach = players[0]->getWidth() + 1;
+    nearby.clear();
+    grid.query(ball.getX1() + ballBox.x1 - reach, ball.getY() - 8,
+               ball.getX1() + ballBox.x2 + reach, ball.getY() + 8,
+               nearby);
+
+    /* players are checked in team order so keep the lowest index that hits */
+    int best = -1;
+    for (vector<unsigned int>::iterator it = nearby.begin(); it != nearby.end(); it++){
+        int index = *it;
+        if ((best == -1 || index < best) && touches(*players[index], ball, ballBox)){
+            best = index;
+        }
+    }
+
+    return best;
+}
+
+/* Every ball goes in each cell its area touches, then the pairs are sorted
+ * by cell so each cell's players are tested against all of its balls in
+ * one go. Keeps the lowest index that hits, same as findHit.
+ */
+void Team::findHits(const vector<Ball*> & balls, vector<int> & hits){
+    hits.assign(balls.size(), -1);
+    if (players.size() == 0 || balls.size() == 0){
+        return;
+    }
+
+    double reach = players[0]->getWidth() + 1;
+    binned.clear();
+    for (unsigned int i = 0; i < balls.size(); i++){
+        const Ball & ball = *balls[i];
+        Box ballBox = ball.collisionBox();
+        nearby.clear();
+        grid.touching(ball.getX1() + ballBox.x1 - reach, ball.getY() - 8,
+                      ball.getX1() + ballBox.x2 + reach, ball.getY() + 8,
+                      nearby);
+        for (vector<unsigned int>::iterator cell = nearby.begin(); cell != nearby.end(); cell++){
+            binned.push_back(std::make_pair(*cell, i));
+        }
+    }
+
+    std::sort(binned.begin(), binned.end());
+
+    for (vector<std::pair<unsigned int, unsigned int> >::iterator it = binned.begin(); it != binned.end(); it++){
+        unsigned int cell = it->first;
+        const Ball & ball = *balls[it->second];
+        Box ballBox = ball.collisionBox();
+        int & best = hits[it->second];
+        for (unsigned int entry = grid.first(cell); entry < grid.last(cell); entry++){
+            int index = grid.entry(entry);
+            if ((best == -1 || index < best) && touches(*players[index], ball, ballBox)){
+                best = index;
+            }
+        }
+    }
+}
+
+/* Finding the hits only looks at where things are, which resolving them
+ * doesn't change, so all of them can be found before any is resolved.
+ */
+void Team::collisionDetection(World & world, const vector<Ball*> & balls){
+    findHits(balls, hits);
+    for (unsigned int i = 0; i < balls.size(); i++){
+        resolveHit(world, *balls[i], hits[i]);
+    }
+}
+
+void Team::collisionDetection(World & world, Ball & ball){
+    resolveHit(world, ball, findHit(ball));
+}
+
+void Team::resolveHit(World & world, Ball & ball, int hit){
+    /* cannot hit multiple players. TODO: some specials can hit multiple players */
+    if (hit != -1){
+        Util::ReferenceCount<Player> player = players[hit];
+
+        /* TODO: handle when the ball is in the air but the player didn't catch it.
+         * The ball should just bounce off of them without them taking damage
+         * but they should show a slight getting-hit animation.
+         */
+        if (player->isCatching() && !player->hasBall() && isFacing(player->getX(), player->getY(), Util::radians(player->getFacingAngle()), ball.getX(), ball.getY())){
+            player->grabBall(ball);
+        } else if (ball.isThrown()){
+            world.playSound(World::HitSound);
+            world.addHit();
+            int damage = ball.getPower();
+            player->collided(ball, damage);
+            ball.collided(*player);
+            world.addFloatingText(toString(damage), player->getX(), player->getY(), player->getZ() + 5);
         }
     }
 }
@@ -1408,37 +1888,84 @@ const std::vector<Util::ReferenceCount<Player> > & Team::getPlayers() const {
     return players;
 }
 
-static Util::ReferenceCount<Player> makePlayer(double x, double y, const Graphics::Color & color, const Box & box, const Util::ReferenceCount<Behavior> & behavior, bool sideline, double health){
-    return Util::ReferenceCount<Player>(new Player(x, y, color, box, behavior, sideline, health));
+bool Team::isHuman() const {
+    return human;
 }
 
-void Team::populateLeft(const Field & field){
-    map.set(Keyboard::Key_Q, Cycle);
+void Team::save(State & state) const {
+    state.controls = controls;
+    state.players = players;
+    state.states.resize(players.size());
+    for (unsigned int i = 0; i < players.size(); i++){
+        players[i]->save(state.states[i]);
+    }
+}
+
+void Team::restore(const State & state){
+    controls = state.controls;
+    players = state.players;
+    for (unsigned int i = 0; i < players.size(); i++){
+        players[i]->restore(state.states[i]);
+    }
+    grid.rebuild(players);
+}
+
+static Util::ReferenceCount<Player> makePlayer(World & world, double x, double y, const Graphics::Color & color, const Box & box, const Util::ReferenceCount<Behavior> & behavior, bool sideline, double health, Random & random){
+    return Util::ReferenceCount<Player>(new Player(world.getBodies(), world.getAnimations(), world.time, x, y, color, box, behavior, sideline, health, randomName(random)));
+}
+
+static Util::ReferenceCount<Behavior> makeBehavior(bool human, const Controls & controls){
+    if (human){
+        return Util::ReferenceCount<Behavior>(new HumanBehavior(controls));
+    }
+    return Util::ReferenceCount<Behavior>(new AIBehavior());
+}
+
+/* players beyond the first three are placed at random at least this far
+ * inside their half
+ */
+static const int rosterMargin = 30;
+
+void Team::populateLeft(World & world, bool human, int count){
+    const Field & field = world.getField();
+    Random & random = world.getRandom();
     double width = field.getWidth() / 2;
     double height = field.getHeight();
     double health = 40;
     Graphics::Color color(Graphics::makeColor(255, 0, 0));
-    players.push_back(makePlayer(width / 5, height / 2, color, Box(0, 0, width, height), Util::ReferenceCount<Behavior>(new HumanBehavior()), false, health + Util::rnd(20)));
-    players.push_back(makePlayer(width / 2, height / 4, color, Box(0, 0, width, height), Util::ReferenceCount<Behavior>(new HumanBehavior()), false, health + Util::rnd(20)));
-    players.push_back(makePlayer(width / 2, height * 3 / 4, color, Box(0, 0, width, height), Util::ReferenceCount<Behavior>(new HumanBehavior()), false, health + Util::rnd(20)));
+    players.push_back(makePlayer(world, width / 5, height / 2, color, Box(0, 0, width, height), makeBehavior(human, controls), false, health + random.rnd(20), random));
+    players.push_back(makePlayer(world, width / 2, height / 4, color, Box(0, 0, width, height), makeBehavior(human, controls), false, health + random.rnd(20), random));
+    players.push_back(makePlayer(world, width / 2, height * 3 / 4, color, Box(0, 0, width, height), makeBehavior(human, controls), false, health + random.rnd(20), random));
+    for (int i = 3; i < count; i++){
+        double x = random.rnd(rosterMargin, width - rosterMargin);
+        double y = random.rnd(rosterMargin, height - rosterMargin);
+        players.push_back(makePlayer(world, x, y, color, Box(0, 0, width, height), makeBehavior(human, controls), false, health + random.rnd(20), random));
+    }
 
-    players.push_back(makePlayer(field.getWidth() - 0, height / 2, color, Box(field.getWidth() - 0, 0, field.getWidth() - 0, height), Util::ReferenceCount<Behavior>(new HumanBehavior()), true, health));
-    players.push_back(makePlayer(field.getWidth() - width / 2, -10, color, Box(field.getWidth() - width, -10, field.getWidth(), -10), Util::ReferenceCount<Behavior>(new HumanBehavior()), true, health));
-    players.push_back(makePlayer(field.getWidth() - width / 2, height + 10, color, Box(field.getWidth() - width, height + 10, field.getWidth(), height + 10), Util::ReferenceCount<Behavior>(new HumanBehavior()), true, health));
+    players.push_back(makePlayer(world, field.getWidth() - 0, height / 2, color, Box(field.getWidth() - 0, 0, field.getWidth() - 0, height), makeBehavior(human, controls), true, health, random));
+    players.push_back(makePlayer(world, field.getWidth() - width / 2, -10, color, Box(field.getWidth() - width, -10, field.getWidth(), -10), makeBehavior(human, controls), true, health, random));
+    players.push_back(makePlayer(world, field.getWidth() - width / 2, height + 10, color, Box(field.getWidth() - width, height + 10, field.getWidth(), height + 10), makeBehavior(human, controls), true, health, random));
 }
 
-void Team::populateRight(const Field & field){
+void Team::populateRight(World & world, bool human, int count){
+    const Field & field = world.getField();
+    Random & random = world.getRandom();
     double width = field.getWidth() / 2;
     double height = field.getHeight();
     double health = 40;
     Graphics::Color color(Graphics::makeColor(0x00, 0xaf, 0x64));
-    players.push_back(makePlayer(field.getWidth() - width / 5, height / 2, color, Box(field.getWidth() - width, 0, field.getWidth(), height), Util::ReferenceCount<Behavior>(new AIBehavior()), false, health + Util::rnd(20)));
-    players.push_back(makePlayer(field.getWidth() - width / 2, height / 4, color, Box(field.getWidth() - width, 0, field.getWidth(), height), Util::ReferenceCount<Behavior>(new AIBehavior()), false, health + Util::rnd(20)));
-    players.push_back(makePlayer(field.getWidth() - width / 2, height * 3 / 4, color, Box(field.getWidth() - width, 0, field.getWidth(), height), Util::ReferenceCount<Behavior>(new AIBehavior()), false, health + Util::rnd(20)));
+    players.push_back(makePlayer(world, field.getWidth() - width / 5, height / 2, color, Box(field.getWidth() - width, 0, field.getWidth(), height), makeBehavior(human, controls), false, health + random.rnd(20), random));
+    players.push_back(makePlayer(world, field.getWidth() - width / 2, height / 4, color, Box(field.getWidth() - width, 0, field.getWidth(), height), makeBehavior(human, controls), false, health + random.rnd(20), random));
+    players.push_back(makePlayer(world, field.getWidth() - width / 2, height * 3 / 4, color, Box(field.getWidth() - width, 0, field.getWidth(), height), makeBehavior(human, controls), false, health + random.rnd(20), random));
+    for (int i = 3; i < count; i++){
+        double x = random.rnd(field.getWidth() - width + rosterMargin, field.getWidth() - rosterMargin);
+        double y = random.rnd(rosterMargin, height - rosterMargin);
+        players.push_back(makePlayer(world, x, y, color, Box(field.getWidth() - width, 0, field.getWidth(), height), makeBehavior(human, controls), false, health + random.rnd(20), random));
+    }
 
-    players.push_back(makePlayer(-10, height / 2, color, Box(-10, 0, -10, height), Util::ReferenceCount<Behavior>(new AIBehavior()), true, health));
-    players.push_back(makePlayer(width / 2, -10, color, Box(0, -10, width, -10), Util::ReferenceCount<Behavior>(new AIBehavior()), true, health));
-    players.push_back(makePlayer(width / 2, height + 10, color, Box(0, height + 10, width, height + 10), Util::ReferenceCount<Behavior>(new AIBehavior()), true, health));
+    players.push_back(makePlayer(world, -10, height / 2, color, Box(-10, 0, -10, height), makeBehavior(human, controls), true, health, random));
+    players.push_back(makePlayer(world, width / 2, -10, color, Box(0, -10, width, -10), makeBehavior(human, controls), true, health, random));
+    players.push_back(makePlayer(world, width / 2, height + 10, color, Box(0, height + 10, width, height + 10), makeBehavior(human, controls), true, health, random));
 }
 
 void Team::enableControl(){
@@ -1461,20 +1988,22 @@ void Team::cycleControl(World & world){
     Util::ReferenceCount<Player> use(NULL);
     double best = 9999;
 
-    const Ball & ball = world.getBall();
-
-    if (onTeam(ball.getHolder())){
-        /* Can't cycle control if someone on the team is holding the ball,
-         * instead you have to pass it.
-         */
-        return;
+    const vector<Ball> & balls = world.getBalls();
+    for (vector<Ball>::const_iterator it = balls.begin(); it != balls.end(); it++){
+        if (onTeam(it->getHolder())){
+            /* Can't cycle control if someone on the team is holding a ball,
+             * instead you have to pass it.
+             */
+            return;
+        }
     }
 
-    /* find closest player to the ball and give him control */
+    /* find closest player to a ball and give him control */
     for (vector<Util::ReferenceCount<Player> >::iterator it = players.begin(); it != players.end(); it++){
         Util::ReferenceCount<Player> player = *it;
         bool control = player->hasControl();
         player->setControl(false);
+        const Ball & ball = world.closestBall(*player);
         double distance = Util::distance(player->getX(), player->getY(), ball.getX(), ball.getY());
         if (!control && distance < best){
             use = player;
@@ -1508,44 +2037,41 @@ void Team::draw(const Graphics::Bitmap & work, const Camera & camera){
     }
 }
 
-void Team::act(World & world){
-    class Handler: public InputHandler<Input> {
-    public:
-        Handler(Team & team, World & world):
-        team(team),
-        world(world){
-        }
+void Team::act(World & world, unsigned int buttons){
+    controls.update(buttons);
+    if (human && controls.wasPressed(Controls::Cycle)){
+        cycleControl(world);
+    }
 
-        Team & team;
-        World & world;
-
-        void press(const Input & out, Keyboard::unicode_t unicode){
-            switch (out){
-                case Cycle: {
-                    team.cycleControl(world);
-                    break;
-                }
-            }
-        }
-
-        void release(const Input & out, Keyboard::unicode_t unicode){
-        }
-    };
-
-    Handler handler(*this, world);
-    InputManager::handleEvents(map, InputSource(0, 0), handler);
+    for (vector<Util::ReferenceCount<Player> >::iterator it = players.begin(); it != players.end(); it++){
+        const Util::ReferenceCount<Player> & player = *it;
+        player->act(world);
+    }
+}
 
+void Team::afterPhysics(World & world){
     for (vector<Util::ReferenceCount<Player> >::iterator it = players.begin(); it != players.end(); it++){
         const Util::ReferenceCount<Player> & player = *it;
-        player->act(world);
+        player->afterPhysics(world);
     }
+
+    /* nobody moves again until next tick */
+    grid.rebuild(players);
 }
 
-Ball::Ball(double x, double y):
+Ball::Ball(double x, double y, double angle):
 x(x),
 y(y),
 z(0),
-angle(Util::rnd(360)),
+angle(angle),
+lastX(x),
+lastY(y),
+lastZ(0),
+toX(x),
+toY(y),
+toZ(0),
+steps(1),
+landing(false),
 velocityX(0),
 velocityY(0),
 velocityZ(0),
@@ -1577,10 +2103,10 @@ void Ball::ungrab(){
 int Ball::getPower() const {
     switch (super){
         case None: return sqrt(velocityX * velocityX + velocityY * velocityY + velocityZ * velocityZ);
-        case Blaster: return Util::rnd(15, 30);
+        /* rolled when the ball was thrown */
+        case Blaster: return power;
     }
     return 0;
-    // power;
 }
     
 double Ball::getVelocityX() const {
@@ -1616,6 +2142,9 @@ bool Ball::isThrown() const {
 
 void Ball::doThrow(World & world, Player & player, double velocityX, double velocityY, double velocityZ, Super super){
     power = 3;
+    if (super == Blaster){
+        power = world.getRandom().rnd(15, 30);
+    }
     this->super = super;
     thrownBy = world.findTeam(player);
     ungrab();
@@ -1667,6 +2196,10 @@ double Ball::getY() const {
 }
 
 void Ball::act(const Field & field){
+    lastX = x;
+    lastY = y;
+    lastZ = z;
+
     if (grabbed && holder != NULL){
         this->x = holder->getX();
         /* add 0.1 to make sure the ball is drawn in front of the player */
@@ -1684,11 +2217,10 @@ void Ball::act(const Field & field){
                 timeInAir -= 1;
             }
         } else {
-            /* When the ball hits the ground its not being thrown anymore */
-            thrown = false;
-            super = None;
-            air = false;
-            timeInAir = 0;
+            /* When the ball hits the ground its not being thrown anymore,
+             * but only once it has been checked against the players
+             */
+            landing = true;
 
             velocityZ = -velocityZ / 2;
             if (fabs(velocityZ) < gravity){
@@ -1744,6 +2276,57 @@ void Ball::act(const Field & field){
     }
 }
 
+/* A player can be hit if the ball is within half a collision box (30 wide)
+ * of them in x and within 8 of their feet in y. Moving less than half of
+ * each per step means the ball can't skip over anyone.
+ */
+static const double maxStepX = 15;
+static const double maxStepY = 8;
+static const int maxSteps = 16;
+
+void Ball::beginSteps(){
+    toX = x;
+    toY = y;
+    toZ = z;
+
+    int stepsX = (int) ceil(fabs(toX - lastX) / maxStepX);
+    int stepsY = (int) ceil(fabs(toY - lastY) / maxStepY);
+    steps = stepsX > stepsY ? stepsX : stepsY;
+    if (steps < 1){
+        steps = 1;
+    }
+    if (steps > maxSteps){
+        steps = maxSteps;
+    }
+}
+
+int Ball::getSteps() const {
+    return steps;
+}
+
+void Ball::land(){
+    if (landing){
+        thrown = false;
+        super = None;
+        air = false;
+        timeInAir = 0;
+        landing = false;
+    }
+}
+
+void Ball::moveToStep(int step){
+    if (step >= steps){
+        x = toX;
+        y = toY;
+        z = toZ;
+    } else {
+        double along = (double) step / steps;
+        x = lastX + (toX - lastX) * along;
+        y = lastY + (toY - lastY) * along;
+        z = lastZ + (toZ - lastZ) * along;
+    }
+}
+
 void Ball::draw(const Graphics::Bitmap & work, const Camera & camera){
     int size = 25;
     int middleX = camera.computeX(x);
@@ -1780,11 +2363,71 @@ Box Ball::collisionBox() const {
     return Box(0, 0, size, size);
 }
 
-World::World():
+MatchSettings::MatchSettings(unsigned int seed):
+seed(seed),
+humanLeft(true),
+humanRight(false),
+players(3),
+balls(1){
+}
+
+/* the process wide managers, only safe on the main thread */
+static Util::ReferenceCount<AnimationManager> orInstance(const Util::ReferenceCount<AnimationManager> & animations){
+    if (animations != NULL){
+        return animations;
+    }
+    return AnimationManager::instance();
+}
+
+static Util::ReferenceCount<SoundManager> orInstance(const Util::ReferenceCount<SoundManager> & sounds){
+    if (sounds != NULL){
+        return sounds;
+    }
+    return SoundManager::instance();
+}
+
+static const char * const soundFiles[World::SoundEffects] = {
+    "beat1.wav",
+    "throw.wav",
+    "super.wav"
+};
+
+static void getHandles(SoundManager & sounds, SoundManager::Handle * handles){
+    for (int i = 0; i < World::SoundEffects; i++){
+        handles[i] = sounds.getHandle(Filesystem::RelativePath(soundFiles[i]));
+    }
+}
+
+/* the first ball starts where it always has, any others are spread out
+ * along the center line
+ */
+static vector<Ball> makeBalls(const Field & field, Random & random, int count){
+    /* there is always at least one ball, whatever was asked for */
+    if (count < 1){
+        count = 1;
+    }
+    vector<Ball> balls;
+    balls.reserve(count);
+    balls.push_back(Ball(400, 300, random.rnd(360)));
+    for (int i = 1; i < count; i++){
+        double y = field.getHeight() * i / count;
+        balls.push_back(Ball(field.getWidth() / 2, y, random.rnd(360)));
+    }
+    return balls;
+}
+
+World::World(const MatchSettings & settings):
 field(1200, 600),
-ball(400, 300),
-team1(Team::LeftSide, field),
-team2(Team::RightSide, field){
+seed(settings.seed),
+random(settings.seed),
+animations(orInstance(settings.animations)),
+sounds(orInstance(settings.sounds)),
+balls(makeBalls(field, random, settings.balls)),
+team1(Team::LeftSide, *this, settings.humanLeft, settings.players),
+team2(Team::RightSide, *this, settings.humanRight, settings.players),
+showProfile(false),
+time(0),
+hits(0){
     camera.moveTo(field.getWidth() / 2, field.getHeight() / 2);
     map.set(Keyboard::Key_LEFT, Left);
     map.set(Keyboard::Key_RIGHT, Right);
@@ -1792,13 +2435,18 @@ team2(Team::RightSide, field){
     map.set(Keyboard::Key_DOWN, Down);
     map.set(Keyboard::Key_EQUALS, ZoomIn);
     map.set(Keyboard::Key_MINUS, ZoomOut);
+    map.set(Keyboard::Key_F3, ToggleProfile);
                 
     /* preload the sounds */
-    SoundManager::instance()->getSound(Filesystem::RelativePath("beat1.wav"));
-    SoundManager::instance()->getSound(Filesystem::RelativePath("super.wav"));
-    SoundManager::instance()->getSound(Filesystem::RelativePath("throw.wav"));
+    for (int i = 0; i < SoundEffects; i++){
+        sounds->preload(Filesystem::RelativePath(soundFiles[i]));
+    }
+    getHandles(*sounds, soundHandles);
 
     team1.enableControl();
+    team2.enableControl();
+
+    rebuildDrawables();
 }
     
 bool World::isDone(){
@@ -1806,35 +2454,84 @@ bool World::isDone(){
            team2.mainPlayers() == 0;
 }
 
+/* All of the balls are checked against a team at once. A thrown ball can
+ * only hit the other team, a pass can be caught by either team but the left
+ * team gets the first chance.
+ *
+ * Fast balls are walked along the path they took this tick in several
+ * steps so they can't pass through a player. A ball that hits or is caught
+ * is no longer in the air and stays where it touched the player. A ball
+ * that landed this tick is walked too and only lands once it's done.
+ */
 void World::collisionDetection(){
-    if (ball.inAir()){
-        if (ball.isThrown()){
-            if (ball.thrownBy == team1.getSide()){
-                team2.collisionDetection(*this, ball);
+    moving.clear();
+    int most = 0;
+    for (vector<Ball>::iterator it = balls.begin(); it != balls.end(); it++){
+        Ball & ball = *it;
+        if (ball.inAir()){
+            ball.beginSteps();
+            moving.push_back(&ball);
+            if (ball.getSteps() > most){
+                most = ball.getSteps();
+            }
+        }
+    }
+
+    for (int step = 1; step <= most; step++){
+        against1.clear();
+        against2.clear();
+        passes.clear();
+
+        for (vector<Ball*>::iterator it = moving.begin(); it != moving.end(); it++){
+            Ball & ball = **it;
+            if (!ball.inAir() || step > ball.getSteps()){
+                continue;
+            }
+
+            ball.moveToStep(step);
+
+            if (ball.isThrown()){
+                if (ball.thrownBy == team1.getSide()){
+                    against2.push_back(&ball);
+                } else {
+                    against1.push_back(&ball);
+                }
             } else {
-                team1.collisionDetection(*this, ball);
+                against1.push_back(&ball);
+                passes.push_back(&ball);
             }
-        } else {
-            team1.collisionDetection(*this, ball);
-            if (ball.inAir()){
-                team2.collisionDetection(*this, ball);
+        }
+
+        team1.collisionDetection(*this, against1);
+
+        for (vector<Ball*>::iterator it = passes.begin(); it != passes.end(); it++){
+            Ball * ball = *it;
+            if (ball->inAir()){
+                against2.push_back(ball);
             }
         }
+
+        team2.collisionDetection(*this, against2);
+    }
+
+    for (vector<Ball>::iterator it = balls.begin(); it != balls.end(); it++){
+        it->land();
     }
 }
 
-static void eraseDead(vector<Util::ReferenceCount<FloatingText> > & stuff){
+static void eraseDead(World & world, vector<Util::ReferenceCount<FloatingText> > & stuff){
     for (vector<Util::ReferenceCount<FloatingText> >::iterator it = stuff.begin(); it != stuff.end(); /**/){
         Util::ReferenceCount<FloatingText> text = *it;
         if (text->alive()){
             it++;
         } else {
+            world.removeDrawable(text.raw());
             it = stuff.erase(it);
         }
     }
 }
 
-void World::run(){
+void World::readInput(unsigned int & left, unsigned int & right){
     class Handler: public InputHandler<Input> {
     public:
         Handler(World & world):
@@ -1869,6 +2566,10 @@ void World::run(){
                     world.camera.zoomOut(0.02);
                     break;
                 }
+                case ToggleProfile: {
+                    world.showProfile = !world.showProfile;
+                    break;
+                }
             }
         }
 
@@ -1878,28 +2579,89 @@ void World::run(){
         World & world;
     };
 
+    PROFILE(profile, Input);
+    unsigned int buttons = 0;
+    if (!isHeadless()){
+        Handler handler(*this);
+        InputManager::handleEvents(map, InputSource(0, 0), handler);
+        buttons = keyboard.poll();
+    }
+
+    left = team1.isHuman() ? buttons : 0;
+    right = team2.isHuman() ? buttons : 0;
+}
+
+void World::run(){
+    unsigned int left = 0;
+    unsigned int right = 0;
+    readInput(left, right);
+    run(left, right);
+}
+
+void World::run(unsigned int left, unsigned int right){
     time += 1;
 
-    Handler handler(*this);
+    {
+        PROFILE(profile, Team1);
+        team1.act(*this, left);
+    }
 
-    InputManager::handleEvents(map, InputSource(0, 0), handler);
-    team1.act(*this);
-    team2.act(*this);
-    ball.act(field);
+    {
+        PROFILE(profile, Team2);
+        team2.act(*this, right);
+    }
 
-    collisionDetection();
+    {
+        PROFILE(profile, Physics);
+        bodies.integrate(gravity, field.getFriction());
+    }
 
-    for (vector<Util::ReferenceCount<FloatingText> >::iterator it = floatingText.begin(); it != floatingText.end(); it++){
-        Util::ReferenceCount<FloatingText> text = *it;
-        text->act();
+    {
+        PROFILE(profile, AfterPhysics);
+        team1.afterPhysics(*this);
+        team2.afterPhysics(*this);
+    }
+
+    {
+        PROFILE(profile, Balls);
+        for (vector<Ball>::iterator it = balls.begin(); it != balls.end(); it++){
+            it->act(field);
+        }
+    }
+
+    {
+        PROFILE(profile, Collision);
+        collisionDetection();
+    }
+
+    {
+        PROFILE(profile, FloatingText);
+        for (vector<Util::ReferenceCount<FloatingText> >::iterator it = floatingText.begin(); it != floatingText.end(); it++){
+            Util::ReferenceCount<FloatingText> text = *it;
+            text->act();
+        }
+
+        eraseDead(*this, floatingText);
     }
 
-    eraseDead(floatingText);
+    sounds->flush();
+
+    {
+        PROFILE(profile, RemoveDead);
+        team1.removeDead(*this);
+        team2.removeDead(*this);
+    }
 
-    team1.removeDead(*this);
-    team2.removeDead(*this);
+    PROFILE(profile, Camera);
 
-    camera.moveTowards(ball.getX(), ball.getY());
+    /* follow the middle of all the balls */
+    double ballX = 0;
+    double ballY = 0;
+    for (vector<Ball>::iterator it = balls.begin(); it != balls.end(); it++){
+        ballX += it->getX();
+        ballY += it->getY();
+    }
+    camera.moveTowards(ballX / balls.size(), ballY / balls.size());
     int xbounds = 50;
     int ybounds = 30;
     if (camera.getX1() < -xbounds && camera.getX2() < field.getWidth()){
@@ -1937,31 +2699,59 @@ void World::moveDown(){
     camera.moveDown(5);
 }
 
-vector<Drawable*> World::getDrawables(){
-    vector<Drawable*> out;
+void World::rebuildDrawables(){
+    /* clear() keeps the capacity so this only allocates when the world grows */
+    drawables.clear();
 
-    out.push_back(&ball);
+    for (vector<Ball>::iterator it = balls.begin(); it != balls.end(); it++){
+        drawables.push_back(&*it);
+    }
 
-    vector<Util::ReferenceCount<Player> > players = team1.getPlayers();
-    for (vector<Util::ReferenceCount<Player> >::iterator it = players.begin(); it != players.end(); it++){
-        Util::ReferenceCount<Player> player = *it;
-        out.push_back(player.raw());
+    for (vector<Util::ReferenceCount<Player> >::const_iterator it = team1.getPlayers().begin(); it != team1.getPlayers().end(); it++){
+        drawables.push_back(it->raw());
     }
 
-    players = team2.getPlayers();
-    for (vector<Util::ReferenceCount<Player> >::iterator it = players.begin(); it != players.end(); it++){
-        Util::ReferenceCount<Player> player = *it;
-        out.push_back(player.raw());
+    for (vector<Util::ReferenceCount<Player> >::const_iterator it = team2.getPlayers().begin(); it != team2.getPlayers().end(); it++){
+        drawables.push_back(it->raw());
     }
 
     for (vector<Util::ReferenceCount<FloatingText> >::iterator it = floatingText.begin(); it != floatingText.end(); it++){
-        Util::ReferenceCount<FloatingText> text = *it;
-        out.push_back(text.raw());
+        drawables.push_back(it->raw());
     }
 
-    sort(out.begin(), out.end(), Drawable::order);
+    /* the list comes out in team order, sort it once so the insertion sort
+     * in getDrawables() only has to fix up what moved
+     */
+    std::sort(drawables.begin(), drawables.end(), Drawable::order);
+}
 
-    return out;
+void World::addDrawable(Drawable * drawable){
+    drawables.push_back(drawable);
+}
+
+void World::removeDrawable(Drawable * drawable){
+    vector<Drawable*>::iterator found = find(drawables.begin(), drawables.end(), drawable);
+    if (found != drawables.end()){
+        drawables.erase(found);
+    }
+}
+
+/* Things only move a little between frames so the list is nearly sorted
+ * already and an insertion sort does about one comparison per entry. New
+ * entries were appended at the end and sink to their place.
+ */
+const vector<Drawable*> & World::getDrawables(){
+    for (unsigned int i = 1; i < drawables.size(); i++){
+        Drawable * what = drawables[i];
+        unsigned int j = i;
+        while (j > 0 && Drawable::order(what, drawables[j - 1])){
+            drawables[j] = drawables[j - 1];
+            j -= 1;
+        }
+        drawables[j] = what;
+    }
+
+    return drawables;
 }
 
 void World::drawOverlay(const Graphics::Bitmap & work){
@@ -2005,24 +2795,97 @@ void World::drawOverlay(const Graphics::Bitmap & work){
 
 }
 
+/* average and worst microseconds of each phase over the last few ticks */
+void World::drawProfile(const Graphics::Bitmap & work){
+    const Font & font = Font::getDefaultFont(16, 16);
+    int lines = Profile::Phases + 1;
+    int top = work.getHeight() - (font.getHeight() + 1) * lines - 4;
+    work.translucent(0, 0, 0, 160).rectangleFill(0, top, work.getWidth() / 2, work.getHeight(), Graphics::makeColor(0, 0, 0));
+
+    Graphics::Color white = Graphics::makeColor(255, 255, 255);
+    int y = top + 2;
+#ifdef DODGEBALL_PROFILE
+    font.printf(4, y, white, work, "phase            avg us   worst us", 0);
+    y += font.getHeight() + 1;
+    for (int phase = 0; phase < Profile::Phases; phase++){
+        font.printf(4, y, white, work, "%-14s %8.1f %10.1f", 0,
+                    Profile::name((Profile::Phase) phase),
+                    profile.average((Profile::Phase) phase),
+                    profile.worst((Profile::Phase) phase));
+        y += font.getHeight() + 1;
+    }
+#else
+    font.printf(4, y, white, work, "built without DODGEBALL_PROFILE", 0);
+#endif
+}
+
+const Profile::Times & World::getProfile() const {
+    return profile;
+}
+
 void World::draw(const Graphics::Bitmap & screen){
     Graphics::StretchedBitmap work(camera.getWidth(), camera.getHeight(), screen);
     work.start();
-    field.draw(work, camera);
 
-    vector<Drawable*> draws = getDrawables();
-    for (vector<Drawable*>::iterator it = draws.begin(); it != draws.end(); it++){
-        Drawable * what = *it;
-        what->draw(work, camera);
+    {
+        PROFILE(profile, DrawField);
+        field.draw(work, camera);
     }
 
-    drawOverlay(work);
+    {
+        PROFILE(profile, DrawDrawables);
+        const vector<Drawable*> & draws = getDrawables();
+        for (vector<Drawable*>::const_iterator it = draws.begin(); it != draws.end(); it++){
+            Drawable * what = *it;
+            what->draw(work, camera);
+        }
+    }
+
+    {
+        PROFILE(profile, DrawOverlay);
+        drawOverlay(work);
+    }
+
+    if (showProfile){
+        drawProfile(work);
+    }
 
     work.finish();
 }
     
-Ball & World::getBall(){
-    return ball;
+vector<Ball> & World::getBalls(){
+    return balls;
+}
+
+/* Prefer balls that nobody else is holding. If every ball is held by
+ * someone else then just the closest one.
+ */
+Ball & World::closestBall(const Player & who){
+    Ball * best = NULL;
+    double bestDistance = 0;
+    Ball * closest = NULL;
+    double closestDistance = 0;
+
+    for (vector<Ball>::iterator it = balls.begin(); it != balls.end(); it++){
+        Ball & ball = *it;
+        double distance = Util::distance(who.getX(), who.getY(), ball.getX(), ball.getY());
+        if (closest == NULL || distance < closestDistance){
+            closest = &ball;
+            closestDistance = distance;
+        }
+
+        bool free = ball.getHolder() == NULL || ball.getHolder() == &who;
+        if (free && (best == NULL || distance < bestDistance)){
+            best = &ball;
+            bestDistance = distance;
+        }
+    }
+
+    if (best != NULL){
+        return *best;
+    }
+
+    return *closest;
 }
     
 const Field & World::getField() const {
@@ -2033,6 +2896,159 @@ unsigned int World::getTime() const {
     return time;
 }
 
+Random & World::getRandom(){
+    return random;
+}
+
+Bodies & World::getBodies(){
+    return bodies;
+}
+
+Util::ReferenceCount<SoundManager> World::setSounds(const Util::ReferenceCount<SoundManager> & sounds){
+    Util::ReferenceCount<SoundManager> old = this->sounds;
+    this->sounds = sounds;
+    if (otherSounds == sounds){
+        std::swap_ranges(soundHandles, soundHandles + SoundEffects, otherHandles);
+    } else {
+        std::copy(soundHandles, soundHandles + SoundEffects, otherHandles);
+        getHandles(*sounds, soundHandles);
+    }
+    otherSounds = old;
+    return old;
+}
+
+void World::playSound(SoundEffect effect){
+    sounds->play(soundHandles[effect]);
+}
+
+AnimationManager & World::getAnimations(){
+    return *animations;
+}
+
+SoundManager & World::getSounds(){
+    return *sounds;
+}
+
+void World::addHit(){
+    hits += 1;
+}
+
+unsigned int World::getHits() const {
+    return hits;
+}
+
+/* FNV-1a */
+static uint32_t hashBytes(uint32_t hash, const void * data, unsigned int size){
+    const unsigned char * bytes = (const unsigned char *) data;
+    for (unsigned int i = 0; i < size; i++){
+        hash = (hash ^ bytes[i]) * 16777619;
+    }
+    return hash;
+}
+
+template <class X>
+static uint32_t hashValue(uint32_t hash, const X & x){
+    return hashBytes(hash, &x, sizeof(x));
+}
+
+static uint32_t hashTeam(uint32_t hash, const Team & team){
+    const vector<Util::ReferenceCount<Player> > & players = team.getPlayers();
+    hash = hashValue(hash, (unsigned int) players.size());
+    for (vector<Util::ReferenceCount<Player> >::const_iterator it = players.begin(); it != players.end(); it++){
+        const Player & player = **it;
+        hash = hashValue(hash, player.getX());
+        hash = hashValue(hash, player.getY());
+        hash = hashValue(hash, player.getZ());
+        hash = hashValue(hash, player.getHealth());
+        hash = hashValue(hash, (int) player.hasBall());
+    }
+    return hash;
+}
+
+uint32_t World::hash() const {
+    uint32_t hash = 2166136261U;
+    hash = hashValue(hash, time);
+    hash = hashValue(hash, random.getState());
+    for (vector<Ball>::const_iterator it = balls.begin(); it != balls.end(); it++){
+        const Ball & ball = *it;
+        hash = hashValue(hash, ball.x);
+        hash = hashValue(hash, ball.y);
+        hash = hashValue(hash, ball.z);
+        hash = hashValue(hash, ball.velocityX);
+        hash = hashValue(hash, ball.velocityY);
+        hash = hashValue(hash, ball.velocityZ);
+    }
+    hash = hashTeam(hash, team1);
+    hash = hashTeam(hash, team2);
+    return hash;
+}
+
+Snapshot::Snapshot():
+random(0),
+time(0),
+hits(0){
+}
+
+unsigned int Snapshot::size() const {
+    unsigned int bytes = sizeof(Snapshot);
+    bytes += bodies.size() * (sizeof(double) * 7 + sizeof(unsigned char));
+    bytes += balls.size() * sizeof(Ball);
+    bytes += team1.players.size() * (sizeof(Util::ReferenceCount<Player>) + sizeof(Player::State));
+    bytes += team2.players.size() * (sizeof(Util::ReferenceCount<Player>) + sizeof(Player::State));
+    bytes += floatingText.size() * (sizeof(Util::ReferenceCount<FloatingText>) + sizeof(FloatingText::State));
+    return bytes;
+}
+
+void World::save(Snapshot & snapshot) const {
+    snapshot.camera = camera;
+    snapshot.random = random.getState();
+    snapshot.time = time;
+    snapshot.hits = hits;
+    bodies.save(snapshot.bodies);
+    snapshot.balls = balls;
+    team1.save(snapshot.team1);
+    team2.save(snapshot.team2);
+    snapshot.floatingText = floatingText;
+    snapshot.floatingStates.resize(floatingText.size());
+    for (unsigned int i = 0; i < floatingText.size(); i++){
+        floatingText[i]->save(snapshot.floatingStates[i]);
+    }
+}
+
+/* The balls vector is the same size as it was when saved, so the players
+ * holding balls still point at the right ones.
+ */
+void World::restore(const Snapshot & snapshot){
+    camera = snapshot.camera;
+    random.setState(snapshot.random);
+    time = snapshot.time;
+    hits = snapshot.hits;
+    bodies.restore(snapshot.bodies);
+    balls = snapshot.balls;
+    team1.restore(snapshot.team1);
+    team2.restore(snapshot.team2);
+    floatingText = snapshot.floatingText;
+    for (unsigned int i = 0; i < floatingText.size(); i++){
+        floatingText[i]->restore(snapshot.floatingStates[i]);
+    }
+    rebuildDrawables();
+}
+
+unsigned int World::getSeed() const {
+    return seed;
+}
+
+void World::playing(vector<const Animation*> & out) const {
+    const vector<Util::ReferenceCount<Player> > & left = team1.getPlayers();
+    for (vector<Util::ReferenceCount<Player> >::const_iterator it = left.begin(); it != left.end(); it++){
+        out.push_back((*it)->getPlaying());
+    }
+    const vector<Util::ReferenceCount<Player> > & right = team2.getPlayers();
+    for (vector<Util::ReferenceCount<Player> >::const_iterator it = right.begin(); it != right.end(); it++){
+        out.push_back((*it)->getPlaying());
+    }
+}
+
 bool World::onTeam(const Team & team, const Player & who){
     return team.onTeam(&who);
 }
@@ -2154,7 +3170,7 @@ Util::ReferenceCount<Player> World::passTarget(const std::vector<Util::Reference
             }
         }
 
-        return copy[Util::rnd(0, copy.size() - 1)];
+        return copy[getRandom().rnd(0, copy.size() - 1)];
     }
 
     return best;
@@ -2169,6 +3185,7 @@ Util::ReferenceCount<Player> World::passTarget(Player & who){
     
 void World::addFloatingText(const std::string & text, double x, double y, double z){
     floatingText.push_back(Util::ReferenceCount<FloatingText>(new FloatingText(text, x, y, z)));
+    addDrawable(floatingText.back().raw());
 }
 
 FloatingText::FloatingText(const std::string & text, double x, double y, double z):
@@ -2198,13 +3215,26 @@ void FloatingText::act(){
     z += 1;
 }
 
+void FloatingText::save(State & state) const {
+    state.z = z;
+    state.life = life;
+    state.angle = angle;
+}
+
+void FloatingText::restore(const State & state){
+    z = state.z;
+    life = state.life;
+    angle = state.angle;
+}
+
 void FloatingText::draw(const Graphics::Bitmap & work, const Camera & camera){
     int drawX = camera.computeX(x + cos(angle / 4) * 5);
     int drawY = camera.computeY(y - z);
     Font::getDefaultFont(40, 40).printf(drawX, drawY, Graphics::makeColor(255, 255, 255), work, text, 0);
 }
 
-SoundManager::SoundManager(){
+SoundManager::SoundManager():
+used(0){
 }
 
 SoundManager::~SoundManager(){
@@ -2216,78 +3246,222 @@ void SoundManager::destroy(){
     manager = NULL;
 }
 
+/* Used when headless, nothing is loaded and nothing is played */
+class NullSoundManager: public SoundManager {
+public:
+    NullSoundManager(){
+    }
+
+    /* or overriding play(Handle) would hide play(path) */
+    using SoundManager::play;
+
+    virtual void preload(const Path::RelativePath & path){
+    }
+
+    virtual void play(Handle handle){
+    }
+
+    virtual void flush(){
+    }
+};
+
+Util::ReferenceCount<SoundManager> SoundManager::silent(){
+    return Util::ReferenceCount<SoundManager>(new NullSoundManager());
+}
+
 Util::ReferenceCount<SoundManager> SoundManager::instance(){
     if (manager == NULL){
-        manager = Util::ReferenceCount<SoundManager>(new SoundManager());
+        if (isHeadless()){
+            manager = Util::ReferenceCount<SoundManager>(new NullSoundManager());
+        } else {
+            try{
+                Util::ReferenceCount<SoundManager> sounds(new SoundManager());
+                sounds->mixer = Util::ReferenceCount<Mixer>(new Mixer());
+                sounds->mixer->setVolume(Configuration::getSoundVolume() / 100.0);
+                manager = sounds;
+            } catch (const Exception::Base & fail){
+                Global::debug(0) << "Could not open the sound device, playing without sound: " << fail.getTrace() << std::endl;
+                manager = Util::ReferenceCount<SoundManager>(new NullSoundManager());
+            }
+        }
     }
 
     return manager;
 }
 
-Util::ReferenceCount<Sound> SoundManager::getSound(const Path::RelativePath & path){
+Util::ReferenceCount<Pcm> SoundManager::loadSound(const AssetPack * pack, const Path::RelativePath & path){
+    return loadSound(pack, path, locateSound(pack, path));
+}
+
+Filesystem::AbsolutePath SoundManager::locateSound(const AssetPack * pack, const Path::RelativePath & path){
+    if (pack != NULL && pack->hasSound(path.path())){
+        return Filesystem::AbsolutePath();
+    }
+    return Storage::instance().find(path);
+}
+
+Util::ReferenceCount<Pcm> SoundManager::loadSound(const AssetPack * pack, const Path::RelativePath & path, const Filesystem::AbsolutePath & file){
+    if (pack != NULL && pack->hasSound(path.path())){
+        return pack->loadSound(path.path());
+    }
+    return Util::ReferenceCount<Pcm>(new Pcm(file.path()));
+}
+
+Util::ReferenceCount<Pcm> SoundManager::getSound(const Path::RelativePath & path){
     if (sounds.find(path) == sounds.end()){
-        sounds[path] = Util::ReferenceCount<Sound>(new Sound(Storage::instance().find(path).path()));
+        sounds[path] = loadSound(AssetPack::instance().raw(), path);
     }
 
     return sounds[path];
 }
-    
-AnimationEvent::AnimationEvent(){
+
+void SoundManager::expect(const Path::RelativePath & path){
+    if (sounds.find(path) == sounds.end()){
+        pending.insert(path);
+    }
 }
 
-AnimationEvent::~AnimationEvent(){
+void SoundManager::add(const Path::RelativePath & path, const Util::ReferenceCount<Pcm> & sound){
+    pending.erase(path);
+    if (sound != NULL && sounds.find(path) == sounds.end()){
+        sounds[path] = sound;
+    }
 }
 
-class DelayEvent: public AnimationEvent {
-public:
-    DelayEvent(const Token * token):
-    delay(1){
-        token->view() >> delay;
+void SoundManager::preload(const Path::RelativePath & path){
+    if (pending.find(path) == pending.end()){
+        getSound(path);
     }
-    
-    void invoke(Animation & animation){
-        animation.setDelay(delay);
+}
+
+SoundManager::Handle SoundManager::getHandle(const Path::RelativePath & path){
+    map<Path::RelativePath, Handle>::iterator found = handles.find(path);
+    if (found != handles.end()){
+        return found->second;
     }
 
-    int delay;
-};
+    Handle handle = handlePaths.size();
+    handles[path] = handle;
+    handlePaths.push_back(path);
+    handleSounds.push_back(Util::ReferenceCount<Pcm>());
+    claimed.push_back(0);
+    return handle;
+}
 
-class FrameEvent: public AnimationEvent {
-public:
-    FrameEvent(const Filesystem::AbsolutePath & directory, const Token * token){
-        string path;
-        token->view() >> path;
-        frame = Graphics::Bitmap(directory.join(Filesystem::RelativePath(path)).path());
+void SoundManager::play(const Path::RelativePath & path){
+    play(getHandle(path));
+}
+
+void SoundManager::play(Handle handle){
+    if (used == voices || claimed[handle] == repeatsPerTick){
+        return;
     }
-    
-    void invoke(Animation & animation){
-        animation.setFrame(frame);
+    claimed[handle] += 1;
+    voice[used] = handle;
+    used += 1;
+}
+
+/* Sounds are looked up here rather than in play() so nothing is loaded in
+ * the middle of collision detection. One still loading in the background
+ * is skipped. All that reaches the mixer is a pointer per voice.
+ */
+void SoundManager::flush(){
+    if (used == 0){
+        return;
     }
 
-    Graphics::Bitmap frame;
-};
+    for (unsigned int i = 0; i < used; i++){
+        Handle handle = voice[i];
+        claimed[handle] = 0;
+        Util::ReferenceCount<Pcm> & sound = handleSounds[handle];
+        if (sound == NULL){
+            if (pending.find(handlePaths[handle]) != pending.end()){
+                continue;
+            }
+            sound = getSound(handlePaths[handle]);
+        }
+        mixer->play(sound.raw());
+    }
+    mixer->endTick();
+    used = 0;
+}
 
-class OffsetEvent: public AnimationEvent {
-public:
-    OffsetEvent(const Token * token):
-    x(0),
-    y(0){
-        token->view() >> x >> y;
+void SoundManager::poll(){
+    if (mixer != NULL){
+        mixer->setVolume(Configuration::getSoundVolume() / 100.0);
+        mixer->poll();
     }
+}
     
-    void invoke(Animation & animation){
-        animation.setOffset(x, y);
-    }
+namespace{
+
+/* what an anim block in the character file says, in order */
+struct Event{
+    enum Type{
+        Delay,
+        Frame,
+        Offset
+    };
 
-    int x, y;
+    Type type;
+    int a, b;
 };
-    
-Animation::Animation(const Filesystem::AbsolutePath & directory, const Token * token, unsigned int id):
-x(0), y(0),
-delay(0),
-counter(0),
-loop(false),
-id(id){
+
+/* Lays out one pass over the events. A frame is shown for delay + 1 ticks
+ * and a frame with no delay is replaced in the same tick. The delay and
+ * offset carry over to the next pass, an offset after the last frame only
+ * shows up on the next pass. Returns the tick the next pass starts on.
+ */
+unsigned int compilePass(const vector<Event> & events, unsigned int tick, int & delay, int & x, int & y, vector<Animation::Key> & keys, unsigned int & last){
+    for (vector<Event>::const_iterator it = events.begin(); it != events.end(); it++){
+        const Event & event = *it;
+        switch (event.type){
+            case Event::Delay: {
+                delay = event.a > 0 ? event.a : 0;
+                break;
+            }
+            case Event::Offset: {
+                x = event.a;
+                y = event.b;
+                break;
+            }
+            case Event::Frame: {
+                Animation::Key key;
+                key.start = tick;
+                key.x = x;
+                key.y = y;
+                key.frame = event.a;
+                keys.push_back(key);
+                last = tick + delay;
+                if (delay > 0){
+                    tick += delay + 1;
+                }
+                break;
+            }
+        }
+    }
+    return tick;
+}
+
+bool sameKeys(const vector<Animation::Key> & keys, unsigned int first, unsigned int offset, unsigned int count){
+    for (unsigned int i = 0; i < count; i++){
+        const Animation::Key & a = keys[i];
+        const Animation::Key & b = keys[first + i];
+        if (a.start + offset != b.start || a.x != b.x || a.y != b.y || a.frame != b.frame){
+            return false;
+        }
+    }
+    return true;
+}
+
+bool keyBefore(unsigned int ticks, const Animation::Key & key){
+    return ticks < key.start;
+}
+
+/* full path of every frame an anim block shows, in order */
+vector<Filesystem::AbsolutePath> frameFiles(const Filesystem::AbsolutePath & directory, const Token * token){
+    vector<Filesystem::AbsolutePath> files;
+    Filesystem::AbsolutePath base = directory;
     TokenView view = token->view();
     while (view.hasMore()){
         const Token * next;
@@ -2295,111 +3469,292 @@ id(id){
         if (*next == "basedir"){
             string path;
             next->view() >> path;
-            setBaseDirectory(directory.join(Filesystem::RelativePath(path)));
-        } else if (*next == "delay"){
-            events.push_back(Util::ReferenceCount<AnimationEvent>(new DelayEvent(next)));
+            base = directory.join(Filesystem::RelativePath(path));
         } else if (*next == "frame"){
-            events.push_back(Util::ReferenceCount<AnimationEvent>(new FrameEvent(getBaseDirectory(), next)));
-        } else if (*next == "offset"){
-            events.push_back(Util::ReferenceCount<AnimationEvent>(new OffsetEvent(next)));
+            string path;
+            next->view() >> path;
+            files.push_back(base.join(Filesystem::RelativePath(path)));
         }
     }
-
-    current = events.begin();
-}
-    
-Animation::Animation(const Animation & animation){
-    copy(animation);
+    return files;
+}
+
+/* hash of the size and pixels, to find the same image saved in two files */
+uint32_t hashFrame(const Graphics::Bitmap & frame){
+    uint32_t hash = 2166136261U;
+    hash = hashValue(hash, frame.getWidth());
+    hash = hashValue(hash, frame.getHeight());
+    for (int y = 0; y < frame.getHeight(); y++){
+        for (int x = 0; x < frame.getWidth(); x++){
+            Graphics::Color pixel = frame.getPixel(x, y);
+            unsigned char rgb[3] = {(unsigned char) Graphics::getRed(pixel), (unsigned char) Graphics::getGreen(pixel), (unsigned char) Graphics::getBlue(pixel)};
+            hash = hashBytes(hash, rgb, sizeof(rgb));
+        }
+    }
+    return hash;
 }
 
-Animation & Animation::operator=(const Animation & animation){
-    copy(animation);
-    return *this;
-}
-    
-bool Animation::isDone() const {
-    return counter == 0 && current == events.end();
+bool samePixels(const Graphics::Bitmap & a, const Graphics::Bitmap & b){
+    if (a.getWidth() != b.getWidth() || a.getHeight() != b.getHeight()){
+        return false;
+    }
+    for (int y = 0; y < a.getHeight(); y++){
+        for (int x = 0; x < a.getWidth(); x++){
+            Graphics::Color pa = a.getPixel(x, y);
+            Graphics::Color pb = b.getPixel(x, y);
+            if (Graphics::getRed(pa) != Graphics::getRed(pb) ||
+                Graphics::getGreen(pa) != Graphics::getGreen(pb) ||
+                Graphics::getBlue(pa) != Graphics::getBlue(pb)){
+                return false;
+            }
+        }
+    }
+    return true;
 }
 
-bool Animation::operator==(const Animation & who) const {
-    return id == who.id;
-}
-    
-bool Animation::operator!=(const Animation & who) const {
-    return !(*this == who);
-}
-
-void Animation::copy(const Animation & animation){
-    x = animation.x;
-    y = animation.y;
-    id = animation.id;
-    frame = animation.frame;
-    delay = animation.delay;
-    loop = animation.loop;
-    counter = 0;
-    events = animation.events;
-    current = events.begin();
-    act();
-}
-
-void Animation::act(){
-    if (counter > 0){
-        counter -= 1;
-    } else {
-        if (current == events.end() && !loop){
-        } else {
-            if (current == events.end()){
-                if (loop){
-                    current = events.begin();
-                } else {
-                    return;
-                }
+/* the frames handed out to the decoding threads one at a time */
+struct FrameDecode{
+    FrameDecode(const vector<string> & paths):
+    paths(paths),
+    frames(paths.size(), (Graphics::Bitmap*) NULL),
+    hashes(paths.size()),
+    failures(paths.size()),
+    next(0){
+    }
+
+    const vector<string> & paths;
+    /* pointers so that no two threads ever touch the same reference count */
+    vector<Graphics::Bitmap*> frames;
+    vector<uint32_t> hashes;
+    vector<Util::ReferenceCount<Exception::Base> > failures;
+    /* claimed atomically by the threads */
+    volatile unsigned int next;
+};
+
+void * decodeFrames(void * arg){
+    FrameDecode * decode = (FrameDecode*) arg;
+    while (true){
+        unsigned int frame = __sync_fetch_and_add(&decode->next, 1);
+        if (frame >= decode->paths.size()){
+            break;
+        }
+        try{
+            decode->frames[frame] = new Graphics::Bitmap(decode->paths[frame]);
+            decode->hashes[frame] = hashFrame(*decode->frames[frame]);
+        } catch (const Exception::Base & fail){
+            decode->failures[frame] = Util::ReferenceCount<Exception::Base>(fail.copy());
+        }
+    }
+    return NULL;
+}
+
+/* Decodes every frame the anim blocks show, each file only once even if
+ * several blocks use it, and adds them to the atlas. Files that hold the
+ * same image share one frame in the atlas too, and a frame whose hash is
+ * in known is added empty since the manager has it already. The calling
+ * thread is one of the threads. Gives the atlas index of every frame of
+ * every block, and the hash of every frame added unless headless.
+ */
+vector<vector<unsigned int> > loadFrames(const Filesystem::AbsolutePath & directory, const vector<const Token*> & blocks, Atlas & atlas, vector<uint32_t> & hashes, const std::set<uint32_t> & known, unsigned int threads){
+    vector<vector<unsigned int> > indexes(blocks.size());
+    vector<string> paths;
+    map<string, unsigned int> unique;
+    for (unsigned int i = 0; i < blocks.size(); i++){
+        vector<Filesystem::AbsolutePath> files = frameFiles(directory, blocks[i]);
+        for (vector<Filesystem::AbsolutePath>::iterator it = files.begin(); it != files.end(); it++){
+            map<string, unsigned int>::iterator found = unique.find(it->path());
+            if (found == unique.end()){
+                found = unique.insert(std::make_pair(it->path(), (unsigned int) paths.size())).first;
+                paths.push_back(it->path());
             }
-            do{
-                (*current)->invoke(*this);
-                current++;
-                if (current == events.end()){
-                    if (loop){
-                        current = events.begin();
-                    } else {
-                        break;
-                    }
-                }
-            } while (counter == 0);
+            indexes[i].push_back(found->second);
+        }
+    }
+
+    /* nothing is drawn when headless so don't bother decoding the images */
+    if (isHeadless()){
+        for (unsigned int i = 0; i < paths.size(); i++){
+            atlas.add(Graphics::Bitmap());
         }
+        return indexes;
     }
+
+    FrameDecode decode(paths);
+    vector<Util::Thread::Id> ids;
+    for (unsigned int i = 1; i < threads && i < paths.size(); i++){
+        Util::Thread::Id id;
+        if (Util::Thread::createThread(&id, NULL, (Util::Thread::ThreadFunction) decodeFrames, &decode)){
+            ids.push_back(id);
+        }
+    }
+    decodeFrames(&decode);
+    for (vector<Util::Thread::Id>::iterator it = ids.begin(); it != ids.end(); it++){
+        Util::Thread::joinThread(*it);
+    }
+
+    /* added in the order the files were first used, same as loading them one at a time */
+    Util::ReferenceCount<Exception::Base> failure;
+    vector<unsigned int> slots(paths.size());
+    /* hash to the files already added with it */
+    map<uint32_t, vector<unsigned int> > seen;
+    for (unsigned int i = 0; i < paths.size(); i++){
+        if (decode.frames[i] == NULL){
+            if (failure == NULL){
+                failure = decode.failures[i];
+            }
+            continue;
+        }
+
+        vector<unsigned int> & same = seen[decode.hashes[i]];
+        bool found = false;
+        for (vector<unsigned int>::iterator it = same.begin(); it != same.end() && !found; it++){
+            if (samePixels(*decode.frames[i], *decode.frames[*it])){
+                slots[i] = slots[*it];
+                found = true;
+            }
+        }
+        if (!found){
+            if (known.find(decode.hashes[i]) != known.end()){
+                slots[i] = atlas.add(Graphics::Bitmap());
+            } else {
+                slots[i] = atlas.add(*decode.frames[i]);
+            }
+            hashes.push_back(decode.hashes[i]);
+            same.push_back(i);
+        }
+    }
+
+    for (unsigned int i = 0; i < paths.size(); i++){
+        delete decode.frames[i];
+    }
+    if (failure != NULL){
+        failure->throwSelf();
+    }
+
+    for (vector<vector<unsigned int> >::iterator block = indexes.begin(); block != indexes.end(); block++){
+        for (vector<unsigned int>::iterator it = block->begin(); it != block->end(); it++){
+            *it = slots[*it];
+        }
+    }
+    return indexes;
 }
-    
-void Animation::draw(const Graphics::Bitmap & work, int x, int y, bool faceRight){
-    int trueX = x + this->x - frame.getWidth() / 2;
-    int trueY = y + this->y - frame.getHeight();
-    if (faceRight){
-        frame.draw(trueX, trueY, work);
+
+}
+
+Animation::Animation(const Filesystem::AbsolutePath & directory, const Token * token, const Util::ReferenceCount<FrameTable> & table, const vector<unsigned int> & frames):
+table(table),
+length(0),
+loopKey(0),
+loopStart(0),
+period(0),
+replacement(NULL){
+    vector<Event> events;
+    string base;
+    vector<unsigned int>::const_iterator frame = frames.begin();
+    TokenView view = token->view();
+    while (view.hasMore()){
+        const Token * next;
+        view >> next;
+        Event event;
+        event.a = 0;
+        event.b = 0;
+        if (*next == "basedir"){
+            next->view() >> base;
+            setBaseDirectory(directory.join(Filesystem::RelativePath(base)));
+        } else if (*next == "delay"){
+            event.type = Event::Delay;
+            event.a = 1;
+            next->view() >> event.a;
+            events.push_back(event);
+        } else if (*next == "frame"){
+            string path;
+            next->view() >> path;
+            event.type = Event::Frame;
+            files.push_back(base.empty() ? path : base + "/" + path);
+            event.a = *frame;
+            frame++;
+            events.push_back(event);
+        } else if (*next == "offset"){
+            event.type = Event::Offset;
+            next->view() >> event.a >> event.b;
+            events.push_back(event);
+        }
+    }
+
+    int delay = 0;
+    int x = 0;
+    int y = 0;
+    unsigned int end = compilePass(events, 0, delay, x, y, keys, length);
+    unsigned int once = keys.size();
+
+    /* When looping the second pass starts with whatever delay and offset the
+     * first pass ended with. Usually that changes nothing and all the keys
+     * loop, otherwise the first pass plays once and the second repeats.
+     */
+    unsigned int unused = 0;
+    unsigned int again = compilePass(events, end, delay, x, y, keys, unused);
+    if (sameKeys(keys, once, end, once)){
+        keys.resize(once);
+        loopKey = 0;
+        loopStart = 0;
+        period = end;
     } else {
-        frame.drawHFlip(trueX, trueY, work);
+        loopKey = once;
+        loopStart = end;
+        period = again - end;
     }
 }
-    
-Util::ReferenceCount<Animation> Animation::clone(){
-    return Util::ReferenceCount<Animation>(new Animation(*this));
+
+Animation::Animation(const Util::ReferenceCount<FrameTable> & table, const vector<Key> & keys, unsigned int length, unsigned int loopKey, unsigned int loopStart, unsigned int period):
+table(table),
+keys(keys),
+length(length),
+loopKey(loopKey),
+loopStart(loopStart),
+period(period),
+replacement(NULL){
 }
 
-void Animation::setLoop(bool what){
-    this->loop = what;
+const vector<string> & Animation::getFiles() const {
+    return files;
 }
 
-void Animation::setOffset(int x, int y){
-    this->x = x;
-    this->y = y;
+void Animation::start(Cursor & cursor, unsigned int now, bool loop) const {
+    cursor.definition = this;
+    cursor.start = now;
+    cursor.loop = loop;
 }
 
-void Animation::setFrame(const Graphics::Bitmap & bitmap){
-    this->frame = bitmap;
-    counter = delay;
+/* binary search for the last key that started at or before ticks */
+const Animation::Key * Animation::find(unsigned int ticks, bool loop) const {
+    if (keys.empty()){
+        return NULL;
+    }
+
+    /* the keys of the second pass are only for looping */
+    vector<Key>::const_iterator end = keys.end();
+    if (!loop && loopKey > 0){
+        end = keys.begin() + loopKey;
+    }
+
+    /* a loop where every frame has no delay never gets past the first tick */
+    if (loop && period > 0 && ticks >= loopStart){
+        ticks = loopStart + (ticks - loopStart) % period;
+    }
+
+    vector<Key>::const_iterator found = std::upper_bound(keys.begin(), end, ticks, keyBefore);
+    if (found == keys.begin()){
+        return &*found;
+    }
+    return &*(found - 1);
 }
 
-void Animation::setDelay(int delay){
-    this->delay = delay;
+const Graphics::Bitmap & Animation::getFrame(const Key & key) const {
+    return table->get(key.frame);
+}
+
+const Graphics::Bitmap & Animation::getFlippedFrame(const Key & key) const {
+    return table->getFlipped(key.frame);
 }
 
 const Filesystem::AbsolutePath & Animation::getBaseDirectory() const {
@@ -2413,50 +3768,488 @@ void Animation::setBaseDirectory(const Filesystem::AbsolutePath & path){
 Animation::~Animation(){
 }
 
+Animation::Cursor::Cursor():
+definition(NULL),
+start(0),
+loop(false){
+}
+
+bool Animation::Cursor::isPlaying(const Animation & animation) const {
+    for (const Animation * playing = definition; playing != NULL; playing = playing->replacement){
+        if (playing == &animation){
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Animation::Cursor::isDone(unsigned int now) const {
+    if (definition == NULL){
+        return true;
+    }
+    return !loop && now - start >= definition->length;
+}
+
+void Animation::Cursor::draw(const Graphics::Bitmap & work, int x, int y, bool faceRight, unsigned int now) const {
+    if (definition == NULL){
+        return;
+    }
+
+    const Key * key = definition->find(now - start, loop);
+    if (key == NULL){
+        return;
+    }
+
+    /* the atlas keeps a mirrored copy of every frame for facing left */
+    const Graphics::Bitmap & frame = faceRight ? definition->getFrame(*key) : definition->getFlippedFrame(*key);
+    int trueX = x + key->x - frame.getWidth() / 2;
+    int trueY = y + key->y - frame.getHeight();
+    frame.draw(trueX, trueY, work);
+}
+
+static const char * const animationNames[AnimationSet::Names] = {
+    "idle",
+    "walk",
+    "run",
+    "jump",
+    "punch",
+    "get",
+    "pain",
+    "fall",
+    "rise",
+    "upper-cut"
+};
+
+AnimationSet::AnimationSet(AnimationManager & manager, const std::string & path){
+    update(manager, path);
+}
+
+void AnimationSet::update(AnimationManager & manager, const std::string & path){
+    for (int i = 0; i < Names; i++){
+        animations[i] = manager.getAnimation(path, animationNames[i]);
+    }
+}
+
+const Animation & AnimationSet::get(Name name) const {
+    return *animations[name];
+}
+
 Util::ReferenceCount<AnimationManager> AnimationManager::manager; 
 Util::ReferenceCount<AnimationManager> AnimationManager::instance(){
     if (manager == NULL){
-        manager = Util::ReferenceCount<AnimationManager>(new AnimationManager());
+        manager = Util::ReferenceCount<AnimationManager>(new AnimationManager(AssetPack::instance().raw()));
     }
 
     return manager;
 }
     
 AnimationManager::AnimationManager():
-id(0){
+pack(NULL),
+decodeThreads(defaultDecodeThreads()){
+}
+
+AnimationManager::AnimationManager(const AssetPack * pack):
+pack(pack),
+decodeThreads(defaultDecodeThreads()){
+}
+
+unsigned int AnimationManager::defaultDecodeThreads(){
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    return processors > 0 ? (unsigned int) processors : 1;
+}
+
+void AnimationManager::setDecodeThreads(unsigned int threads){
+    decodeThreads = threads < 1 ? 1 : threads;
 }
     
 AnimationManager::~AnimationManager(){
 }
 
-map<string, Util::ReferenceCount<Animation> > AnimationManager::loadAnimations(const std::string & path){
+map<string, Util::ReferenceCount<Animation> > AnimationManager::loadAnimations(const std::string & path) const {
+    return loadAnimations(path, locate(path), knownFrames());
+}
+
+Filesystem::AbsolutePath AnimationManager::locate(const std::string & path) const {
+    if (pack != NULL && pack->hasCharacter(path)){
+        /* the loose files are only needed if the pack's copy is damaged */
+        try{
+            return Storage::instance().find(Filesystem::RelativePath(path));
+        } catch (const Exception::Base & fail){
+            return Filesystem::AbsolutePath();
+        }
+    }
+    return Storage::instance().find(Filesystem::RelativePath(path));
+}
+
+map<string, Util::ReferenceCount<Animation> > AnimationManager::loadAnimations(const std::string & path, const Filesystem::AbsolutePath & directory, const std::set<uint32_t> & known) const {
+    if (pack != NULL && pack->hasCharacter(path)){
+        /* a damaged pack shouldn't stop the loose files from loading */
+        try{
+            return pack->loadCharacter(path);
+        } catch (const PackException & fail){
+            if (directory.path() == ""){
+                throw;
+            }
+            Global::debug(0) << "Could not load " << path << " from the asset pack: " << fail.getTrace() << std::endl;
+        }
+    }
+
     TokenReader reader;
-    Filesystem::AbsolutePath directory = Storage::instance().find(Filesystem::RelativePath(path));
     Token * token = reader.readTokenFromFile(directory.join(Filesystem::RelativePath(path + ".txt")).path());
     
     map<string, Util::ReferenceCount<Animation> > animations;
+    Util::ReferenceCount<Atlas> atlas(new Atlas());
+    vector<uint32_t> hashes;
 
+    /* every frame is decoded before any animation is built so the decoding
+     * can be spread over threads
+     */
+    vector<const Token*> blocks;
+    vector<string> names;
     vector<const Token*> data = token->findTokens("_/anim");
     for (vector<const Token*>::iterator it = data.begin(); it != data.end(); it++){
         const Token * animationToken = *it;
         string name;
         if (animationToken->match("_/name", name)){
-            animations[name] = new Animation(directory, animationToken, id);
-            id += 1;
+            blocks.push_back(animationToken);
+            names.push_back(name);
         }
     }
 
+    vector<vector<unsigned int> > frames = loadFrames(directory, blocks, *atlas, hashes, known, decodeThreads);
+    atlas->pack();
+    Util::ReferenceCount<FrameTable> table(new FrameTable(atlas, path, hashes));
+    for (unsigned int i = 0; i < blocks.size(); i++){
+        animations[names[i]] = new Animation(directory, blocks[i], table, frames[i]);
+    }
+
     return animations;
 }
     
-Util::ReferenceCount<Animation> AnimationManager::getAnimation(const std::string & path, const std::string & animation){
+void AnimationManager::add(const std::string & path, const map<string, Util::ReferenceCount<Animation> > & animations){
+    if (!has(path)){
+        sets[path] = animations;
+        share(animations, true);
+        watch(path);
+    }
+}
+
+bool AnimationManager::has(const std::string & path) const {
+    return sets.find(path) != sets.end();
+}
+
+const map<string, Util::ReferenceCount<Animation> > & AnimationManager::getAnimations(const std::string & path){
     if (sets.find(path) == sets.end()){
         sets[path] = loadAnimations(path);
+        share(sets[path], true);
+        watch(path);
     }
 
+    return sets[path];
+}
+
+Util::ReferenceCount<Animation> AnimationManager::getAnimation(const std::string & path, const std::string & animation){
+    getAnimations(path);
     return sets[path][animation];
 }
+
+const AnimationSet & AnimationManager::getSet(const std::string & path){
+    map<string, Util::ReferenceCount<AnimationSet> >::iterator found = characters.find(path);
+    if (found != characters.end()){
+        return *found->second;
+    }
+
+    Util::ReferenceCount<AnimationSet> set(new AnimationSet(*this, path));
+    characters[path] = set;
+    return *set;
+}
     
+/* frames are 32 bit */
+static uint64_t frameBytes(const Atlas::Region & region){
+    return (uint64_t) region.width * region.height * 4;
+}
+
+/* a reloaded character can keep images no current animation shows */
+static uint64_t saved(uint64_t unshared, uint64_t stored){
+    return unshared > stored ? unshared - stored : 0;
+}
+
+void AnimationManager::report(std::ostream & out) const {
+    /* a frame is the atlas it is in and where in it */
+    typedef std::pair<const Atlas*, unsigned int> Image;
+    std::set<Image> all;
+    std::set<const Atlas*> atlases;
+    uint64_t allStored = 0;
+    uint64_t allUnshared = 0;
+    for (map<string, map<string, Util::ReferenceCount<Animation> > >::const_iterator it = sets.begin(); it != sets.end(); it++){
+        std::set<const FrameTable*> tables;
+        unsigned int shown = 0;
+        uint64_t unshared = 0;
+        for (map<string, Util::ReferenceCount<Animation> >::const_iterator animation = it->second.begin(); animation != it->second.end(); animation++){
+            const Animation & use = *animation->second;
+            tables.insert(use.table.raw());
+            /* keys past loopKey show the same frames again */
+            unsigned int keys = use.loopKey > 0 ? use.loopKey : use.keys.size();
+            for (unsigned int key = 0; key < keys; key++){
+                unshared += frameBytes(use.table->getRegion(use.keys[key].frame));
+                shown += 1;
+            }
+        }
+
+        std::set<Image> images;
+        unsigned int borrowed = 0;
+        uint64_t stored = 0;
+        for (std::set<const FrameTable*>::iterator table = tables.begin(); table != tables.end(); table++){
+            for (unsigned int frame = 0; frame < (*table)->size(); frame++){
+                const FrameTable::Frame & entry = (*table)->getEntry(frame);
+                Image image(entry.atlas.raw(), entry.index);
+                uint64_t bytes = frameBytes((*table)->getRegion(frame));
+                if (images.insert(image).second){
+                    stored += bytes;
+                    if (entry.owner != it->first){
+                        borrowed += 1;
+                    }
+                }
+                if (all.insert(image).second){
+                    allStored += bytes;
+                }
+                atlases.insert(entry.atlas.raw());
+            }
+        }
+
+        out << it->first << ": " << shown << " frames shown, " << images.size() << " images"
+            << ", " << borrowed << " from other characters, " << stored << " bytes"
+            << ", " << unshared << " bytes unshared, " << saved(unshared, stored) << " saved" << std::endl;
+        allUnshared += unshared;
+    }
+
+    uint64_t sheets = 0;
+    for (std::set<const Atlas*>::iterator atlas = atlases.begin(); atlas != atlases.end(); atlas++){
+        /* and its mirror image */
+        sheets += (uint64_t) (*atlas)->getSheet().getWidth() * (*atlas)->getSheet().getHeight() * 4 * 2;
+    }
+
+    out << "total: " << all.size() << " images, " << allStored << " bytes, " << allUnshared << " bytes unshared"
+        << ", " << saved(allUnshared, allStored) << " saved, " << sheets << " bytes of sheets" << std::endl;
+}
+
+/* The hash covers the size as well as the pixels, so it is trusted on its
+ * own rather than comparing pixels here on the main thread.
+ */
+void AnimationManager::share(const map<string, Util::ReferenceCount<Animation> > & animations, bool keep){
+    if (animations.empty()){
+        return;
+    }
+
+    /* every animation of one load shares the table */
+    FrameTable & table = *animations.begin()->second->table;
+    if (isHeadless() || table.hashes.size() != table.size()){
+        return;
+    }
+
+    for (unsigned int i = 0; i < table.size(); i++){
+        map<uint32_t, FrameTable::Frame>::iterator found = shared.find(table.hashes[i]);
+        if (found != shared.end()){
+            table.set(i, found->second);
+        } else if (keep && table.getRegion(i).width > 0){
+            shared[table.hashes[i]] = table.getEntry(i);
+        }
+    }
+}
+
+std::set<uint32_t> AnimationManager::knownFrames() const {
+    std::set<uint32_t> known;
+    for (map<uint32_t, FrameTable::Frame>::const_iterator it = shared.begin(); it != shared.end(); it++){
+        known.insert(known.end(), it->first);
+    }
+    return known;
+}
+
+void AnimationManager::enableReload(){
+    if (watcher != NULL){
+        return;
+    }
+
+    watcher = Util::ReferenceCount<FileWatcher>(new FileWatcher());
+    for (map<string, map<string, Util::ReferenceCount<Animation> > >::iterator it = sets.begin(); it != sets.end(); it++){
+        watch(it->first);
+    }
+}
+
+/* Reads the character's file again rather than keeping the tokens around
+ * from the load, which might have come from a pack or another thread.
+ */
+void AnimationManager::watch(const std::string & path){
+    if (watcher == NULL){
+        return;
+    }
+
+    try{
+        Watched & character = watched[path];
+        character.directory = Storage::instance().find(Filesystem::RelativePath(path));
+        character.definition = character.directory.join(Filesystem::RelativePath(path + ".txt")).path();
+        TokenReader reader;
+        readWatched(character, reader.readTokenFromFile(character.definition));
+        watcher->watch(character.directory.path());
+        for (map<string, std::set<string> >::iterator it = character.frames.begin(); it != character.frames.end(); it++){
+            watcher->watch(Filesystem::AbsolutePath(it->first).getDirectory().path());
+        }
+    } catch (const Exception::Base & fail){
+        Global::debug(0) << "Can't reload " << path << ": " << fail.getTrace() << std::endl;
+        watched.erase(path);
+    }
+}
+
+void AnimationManager::readWatched(Watched & character, const Token * token) const {
+    character.blocks.clear();
+    character.frames.clear();
+    vector<const Token*> data = token->findTokens("_/anim");
+    for (vector<const Token*>::iterator it = data.begin(); it != data.end(); it++){
+        const Token * animationToken = *it;
+        string name;
+        if (!animationToken->match("_/name", name)){
+            continue;
+        }
+
+        character.blocks[name] = animationToken->toString();
+        vector<Filesystem::AbsolutePath> files = frameFiles(character.directory, animationToken);
+        for (vector<Filesystem::AbsolutePath>::iterator frame = files.begin(); frame != files.end(); frame++){
+            character.frames[FileWatcher::join(frame->getDirectory().path(), frame->getFilename().path())].insert(name);
+        }
+    }
+}
+
+void AnimationManager::reload(){
+    if (watcher == NULL){
+        return;
+    }
+
+    vector<string> changed = watcher->changed();
+    if (changed.empty()){
+        return;
+    }
+
+    for (map<string, Watched>::iterator it = watched.begin(); it != watched.end(); it++){
+        const Watched & character = it->second;
+        bool definition = false;
+        std::set<string> animations;
+        for (vector<string>::iterator file = changed.begin(); file != changed.end(); file++){
+            if (*file == character.definition){
+                definition = true;
+            }
+            map<string, std::set<string> >::const_iterator frame = character.frames.find(*file);
+            if (frame != character.frames.end()){
+                animations.insert(frame->second.begin(), frame->second.end());
+            }
+        }
+
+        if (definition || !animations.empty()){
+            try{
+                reload(it->first, definition, animations);
+            } catch (const Exception::Base & fail){
+                /* most likely the file was saved half edited, keep what was there */
+                Global::debug(0) << "Could not reload " << it->first << ": " << fail.getTrace() << std::endl;
+            }
+        }
+    }
+}
+
+/* A cursor on a retired animation follows its replacements, so everything
+ * along that chain has to stay.
+ */
+void AnimationManager::release(const World & world){
+    if (retired.empty()){
+        return;
+    }
+
+    vector<const Animation*> playing;
+    world.playing(playing);
+    std::set<const Animation*> reachable;
+    for (vector<const Animation*>::iterator it = playing.begin(); it != playing.end(); it++){
+        for (const Animation * animation = *it; animation != NULL; animation = animation->replacement){
+            reachable.insert(animation);
+        }
+    }
+
+    vector<Util::ReferenceCount<Animation> > keep;
+    for (vector<Util::ReferenceCount<Animation> >::iterator it = retired.begin(); it != retired.end(); it++){
+        if (reachable.find(it->raw()) != reachable.end()){
+            keep.push_back(*it);
+        }
+    }
+    retired.swap(keep);
+}
+
+/* animations are the ones whose frames changed, if the definition changed
+ * too any anim block that reads differently is added to them
+ */
+void AnimationManager::reload(const std::string & path, bool definition, std::set<string> animations){
+    Watched & character = watched[path];
+    TokenReader reader;
+    const Token * token = reader.readTokenFromFile(character.definition);
+    Watched now;
+    now.directory = character.directory;
+    now.definition = character.definition;
+    readWatched(now, token);
+
+    if (definition){
+        for (map<string, string>::iterator it = now.blocks.begin(); it != now.blocks.end(); it++){
+            map<string, string>::iterator old = character.blocks.find(it->first);
+            if (old == character.blocks.end() || old->second != it->second){
+                animations.insert(it->first);
+            }
+        }
+    }
+
+    /* only the reloaded frames go in the new atlas, the rest stay where they were */
+    Util::ReferenceCount<Atlas> atlas(new Atlas());
+    vector<uint32_t> hashes;
+    vector<const Token*> blocks;
+    vector<string> names;
+    vector<const Token*> data = token->findTokens("_/anim");
+    for (vector<const Token*>::iterator it = data.begin(); it != data.end(); it++){
+        const Token * animationToken = *it;
+        string name;
+        if (animationToken->match("_/name", name) && animations.find(name) != animations.end()){
+            blocks.push_back(animationToken);
+            names.push_back(name);
+        }
+    }
+
+    map<string, Util::ReferenceCount<Animation> > fresh;
+    vector<vector<unsigned int> > frames = loadFrames(character.directory, blocks, *atlas, hashes, knownFrames(), decodeThreads);
+    atlas->pack();
+    Util::ReferenceCount<FrameTable> table(new FrameTable(atlas, path, hashes));
+    for (unsigned int i = 0; i < blocks.size(); i++){
+        fresh[names[i]] = Util::ReferenceCount<Animation>(new Animation(character.directory, blocks[i], table, frames[i]));
+    }
+    share(fresh, false);
+
+    /* everything loaded, swap it all in before the next tick */
+    map<string, Util::ReferenceCount<Animation> > & current = sets[path];
+    for (map<string, Util::ReferenceCount<Animation> >::iterator it = fresh.begin(); it != fresh.end(); it++){
+        Util::ReferenceCount<Animation> & old = current[it->first];
+        if (old != NULL){
+            old->replacement = it->second.raw();
+            retired.push_back(old);
+        }
+        old = it->second;
+    }
+
+    map<string, Util::ReferenceCount<AnimationSet> >::iterator set = characters.find(path);
+    if (set != characters.end()){
+        set->second->update(*this, path);
+    }
+
+    character.blocks = now.blocks;
+    character.frames = now.frames;
+    for (map<string, std::set<string> >::iterator it = character.frames.begin(); it != character.frames.end(); it++){
+        watcher->watch(Filesystem::AbsolutePath(it->first).getDirectory().path());
+    }
+
+    Global::debug(0) << "Reloaded " << fresh.size() << " animations of " << path << std::endl;
+}
+
 void AnimationManager::destroy(){
     manager = NULL;
 }
@@ -3,11 +3,18 @@
 
 #include <vector>
 #include <map>
+#include <set>
+#include <ostream>
+#include <stdint.h>
 #include "util/input/input-map.h"
 #include "util/graphics/color.h"
 #include "util/pointer.h"
 #include "util/file-system.h"
-#include "util/sound/sound.h"
+#include "profile.h"
+#include "atlas.h"
+#include "pack.h"
+#include "watch.h"
+#include "audio.h"
 
 class Token;
 
@@ -20,55 +27,151 @@ namespace Dodgeball{
 class World;
 class Ball;
 class Player;
-
-class Animation;
-class AnimationEvent{
+class AnimationManager;
+class SoundManager;
+/* see SoundManager::getHandle() */
+typedef unsigned int SoundHandle;
+
+/* When headless there is no window, sound or keyboard input, only the
+ * simulation runs. Must be set before any World is created.
+ */
+void setHeadless(bool what);
+bool isHeadless();
+
+/* Deterministic random numbers. Every World owns one so that all of the
+ * gameplay randomness in a match comes from its seed.
+ */
+class Random{
 public:
-    AnimationEvent();
-    virtual void invoke(Animation & animation) = 0;
-    virtual ~AnimationEvent();
+    Random(unsigned int seed);
+
+    void setSeed(unsigned int seed);
+
+    uint64_t getState() const;
+    void setState(uint64_t state);
+
+    unsigned int next();
+
+    /* 0 to q - 1 */
+    int rnd(int q);
+    /* q to range - 1 */
+    int rnd(int q, int range);
+
+protected:
+    uint64_t state;
 };
 
+/* One animation as loaded from a character's file, compiled into a list of
+ * keys that say which frame shows at which tick. It is shared by every
+ * player and never changes once loaded.
+ *
+ * Nothing is stepped each tick. A Cursor only remembers the tick the
+ * animation started on and the frame is looked up when somebody asks,
+ * so animations nobody looks at cost nothing.
+ */
 class Animation{
 public:
-    Animation(const Filesystem::AbsolutePath & directory, const Token * token, unsigned int id);
-    Animation(const Animation & copy);
-    Animation & operator=(const Animation & copy);
+    /* frames are the table index of every frame in the block, in order.
+     * They were already decoded and the atlas is packed once the whole
+     * character has loaded.
+     */
+    Animation(const Filesystem::AbsolutePath & directory, const Token * token, const Util::ReferenceCount<FrameTable> & table, const std::vector<unsigned int> & frames);
     virtual ~Animation();
 
-    bool operator==(const Animation & who) const;
-    bool operator!=(const Animation & who) const;
+    /* the frame images relative to the character's directory, empty if the
+     * animation came from an AssetPack
+     */
+    const std::vector<std::string> & getFiles() const;
+
+    /* a frame shown from start ticks after the animation started until the
+     * next key starts
+     */
+    struct Key{
+        unsigned int start;
+        int x, y;
+        unsigned int frame;
+    };
+
+    struct Cursor{
+        Cursor();
 
-    bool isDone() const;
+        /* the animation being played, NULL until one is started */
+        const Animation * definition;
+        /* world tick the animation started on */
+        unsigned int start;
+        bool loop;
 
-    void setBaseDirectory(const Filesystem::AbsolutePath & path);
-    const Filesystem::AbsolutePath & getBaseDirectory() const;
+        /* also true if the animation was reloaded since the cursor started */
+        bool isPlaying(const Animation & animation) const;
+        /* a looping animation is never done */
+        bool isDone(unsigned int now) const;
 
-    void draw(const Graphics::Bitmap & work, int x, int y, bool faceRight);
+        void draw(const Graphics::Bitmap & work, int x, int y, bool faceRight, unsigned int now) const;
+    };
 
-    void setOffset(int x, int y);
-    void setFrame(const Graphics::Bitmap & bitmap);
-    void setDelay(int delay);
-    void setLoop(bool what);
+    void start(Cursor & cursor, unsigned int now, bool loop = false) const;
 
-    void act();
+    /* the key showing the given ticks after the start, NULL if there are no frames */
+    const Key * find(unsigned int ticks, bool loop) const;
 
-    Util::ReferenceCount<Animation> clone();
+    const Graphics::Bitmap & getFrame(const Key & key) const;
+    const Graphics::Bitmap & getFlippedFrame(const Key & key) const;
 
 protected:
-    void copy(const Animation & animation);
+    friend class AssetPack;
+    friend class AnimationManager;
+    /* already compiled, by AssetPack */
+    Animation(const Util::ReferenceCount<FrameTable> & table, const std::vector<Key> & keys, unsigned int length, unsigned int loopKey, unsigned int loopStart, unsigned int period);
+
+    void setBaseDirectory(const Filesystem::AbsolutePath & path);
+    const Filesystem::AbsolutePath & getBaseDirectory() const;
+
+    /* shared by every animation of the character */
+    Util::ReferenceCount<FrameTable> table;
+    /* sorted by start */
+    std::vector<Key> keys;
+    /* a non looping animation is done this many ticks after it starts */
+    unsigned int length;
+    /* once looping, keys from loopKey on repeat every period ticks from loopStart */
+    unsigned int loopKey;
+    unsigned int loopStart;
+    unsigned int period;
 
-    std::vector<Util::ReferenceCount<AnimationEvent> > events;
-    std::vector<Util::ReferenceCount<AnimationEvent> >::iterator current;
     Filesystem::AbsolutePath baseDirectory;
+    std::vector<std::string> files;
+
+    /* the animation that was reloaded in place of this one, if any */
+    const Animation * replacement;
+};
+
+/* The animations of one character looked up by name once, so switching
+ * animation is an array index instead of a map lookup.
+ */
+class AnimationSet{
+public:
+    enum Name{
+        Idle,
+        Walk,
+        Run,
+        Jump,
+        Punch,
+        Get,
+        Pain,
+        Fall,
+        Rise,
+        UpperCut,
+        Names
+    };
+
+    AnimationSet(AnimationManager & manager, const std::string & path);
+
+    /* looks the animations up again after some were reloaded */
+    void update(AnimationManager & manager, const std::string & path);
 
-    int x, y;
-    Graphics::Bitmap frame;
-    int delay;
-    int counter;
-    bool loop;
-    /* globally unique id keeps track of animations for equality */
-    unsigned int id;
+    const Animation & get(Name name) const;
+
+protected:
+    Util::ReferenceCount<Animation> animations[Names];
 };
 
 class Camera{
@@ -143,6 +246,52 @@ struct Box{
     int y2;
 };
 
+/* The buttons for one team during one tick. A bit is set if the button was
+ * down at any time during the tick. Human teams only get input through
+ * these, so the same buttons always play out the same way.
+ */
+struct Controls{
+    enum Button{
+        Left = 1 << 0,
+        Right = 1 << 1,
+        Up = 1 << 2,
+        Down = 1 << 3,
+        Jump = 1 << 4,
+        Catch = 1 << 5,
+        Pass = 1 << 6,
+        /* Either throw or pick up ball */
+        Action = 1 << 7,
+        /* give control to the player closest to a ball */
+        Cycle = 1 << 8
+    };
+
+    Controls();
+
+    /* buttons are the bits for the next tick */
+    void update(unsigned int buttons);
+
+    bool isHeld(Button button) const;
+    bool wasPressed(Button button) const;
+    bool wasReleased(Button button) const;
+
+    unsigned int held;
+    unsigned int pressed;
+    unsigned int released;
+};
+
+/* Reads the keyboard into Controls buttons for someone playing locally */
+class KeyboardControls{
+public:
+    KeyboardControls();
+
+    /* buttons held now or tapped since the last poll */
+    unsigned int poll();
+
+protected:
+    InputMap<Controls::Button> map;
+    unsigned int held;
+};
+
 class Behavior{
 public:
     Behavior();
@@ -152,6 +301,15 @@ public:
     virtual bool hasControl() const = 0;
     virtual void resetInput() = 0;
     virtual void gotBall(Ball & ball) = 0;
+
+    /* whatever the behavior remembers between ticks, as plain ints */
+    struct State{
+        static const int size = 16;
+        int values[size];
+    };
+
+    virtual void save(State & state) const = 0;
+    virtual void restore(const State & state) = 0;
 };
 
 class Drawable{
@@ -166,6 +324,48 @@ public:
     static bool order(Drawable * a, Drawable * b);
 };
 
+/* Positions and velocities of every player in a World kept in parallel
+ * arrays (index by Player::body) so that gravity, friction and movement
+ * can be applied to all of them in a single pass.
+ */
+class Bodies{
+public:
+    Bodies();
+
+    /* returns the index of the new body */
+    unsigned int add(double x, double y);
+    void remove(unsigned int index);
+
+    unsigned int size() const;
+
+    /* copies every body but not the free list, which only changes when a
+     * player is destroyed
+     */
+    void save(Bodies & out) const;
+    void restore(const Bodies & from);
+
+    /* Bodies in the air fall, bodies on the ground slow down by the friction,
+     * then everything moves by its velocity. Sets ground and oldZ.
+     */
+    void integrate(double gravity, double friction);
+
+    std::vector<double> x;
+    std::vector<double> y;
+    std::vector<double> z;
+    std::vector<double> velocityX;
+    std::vector<double> velocityY;
+    std::vector<double> velocityZ;
+
+    /* z after gravity was applied but before moving */
+    std::vector<double> oldZ;
+    /* non-zero if the body was on the ground during the last integrate */
+    std::vector<unsigned char> ground;
+
+protected:
+    /* indices of removed bodies that can be reused */
+    std::vector<unsigned int> unused;
+};
+
 class Player: public Drawable {
 public:
     enum Facing{
@@ -179,9 +379,38 @@ public:
         FaceDownRight
     };
 
-    Player(double x, double y, const Graphics::Color & color, const Box & box, const Util::ReferenceCount<Behavior> & behavior, bool sideline, double health);
+    /* Everything about a player that changes during a match except the
+     * body, which is saved along with the rest of the Bodies.
+     */
+    struct State{
+        State();
+
+        double health;
+        Ball * held;
+        Facing facing;
+        bool backToIdle;
+        bool sideline;
+        int catching;
+        bool forceMove;
+        double wantX;
+        double wantY;
+        int falling;
+        Animation::Cursor animation;
+        Behavior::State behavior;
+    };
+
+    /* the character every player is drawn as */
+    static const char * const character;
+
+    /* clock is the world's tick count, animations are timed from it */
+    Player(Bodies & bodies, AnimationManager & animations, const unsigned int & clock, double x, double y, const Graphics::Color & color, const Box & box, const Util::ReferenceCount<Behavior> & behavior, bool sideline, double health, const std::string & name);
+    virtual ~Player();
 
+    /* Everything up to movement, the world integrates all the bodies
+     * afterwards and then calls afterPhysics.
+     */
     void act(World & world);
+    void afterPhysics(World & world);
     void setControl(bool what);
     bool hasControl() const;
 
@@ -217,7 +446,7 @@ public:
 
     void draw(const Graphics::Bitmap & work, const Camera & camera);
 
-    void dropBall(Ball & ball);
+    void dropBall();
 
     int getFacingAngle() const;
 
@@ -227,6 +456,9 @@ public:
 
     bool isCatching() const;
 
+    /* the animation the player is on, NULL before the first */
+    const Animation * getPlaying() const;
+
     /* upper left x/y for collision detection */
     double getX1() const;
     double getY1() const;
@@ -262,17 +494,20 @@ public:
     void setIdleAnimation();
     void setRiseAnimation();
 
+    void save(State & state) const;
+    void restore(const State & state);
+
 protected:
     void throwBall(World & world, Ball & ball);
-    Util::ReferenceCount<Animation> getAnimation(const std::string & what);
+    const Animation & getAnimation(AnimationSet::Name what) const;
 
-    double x;
-    double y;
-    double z;
+    /* position and velocity are stored in bodies at index body */
+    Bodies * bodies;
+    unsigned int body;
 
-    double velocityX;
-    double velocityY;
-    double velocityZ;
+    /* owned by the world's AnimationManager */
+    const AnimationSet * animations;
+    const unsigned int * clock;
 
     double health;
 
@@ -281,7 +516,8 @@ protected:
     static const double jumpVelocity = 15;
     static double maxRunSpeed;
 
-    bool hasBall_;
+    /* the ball being held, if any */
+    Ball * held;
     Facing facing;
     Box limit;
     Graphics::Color color;
@@ -300,7 +536,44 @@ protected:
     int falling;
 
     Util::ReferenceCount<Behavior> behavior;
-    Util::ReferenceCount<Animation> animation;
+    Animation::Cursor animation;
+};
+
+/* Uniform grid over the field that buckets a team's players by where they
+ * stand so that collision detection only has to look at players near the
+ * ball. Rebuilt every tick after the players have moved.
+ */
+class PlayerGrid{
+public:
+    PlayerGrid(const Field & field);
+
+    static const int cellSize = 64;
+
+    /* the index stored for a player is its position in the vector */
+    void rebuild(const std::vector<Util::ReferenceCount<Player> > & players);
+
+    /* appends the index of every player in a cell touched by the rectangle */
+    void query(double x1, double y1, double x2, double y2, std::vector<unsigned int> & out) const;
+
+    /* appends every cell touched by the rectangle */
+    void touching(double x1, double y1, double x2, double y2, std::vector<unsigned int> & out) const;
+    /* the players in a cell are entries from first(cell) up to last(cell) */
+    unsigned int first(unsigned int cell) const;
+    unsigned int last(unsigned int cell) const;
+    unsigned int entry(unsigned int index) const;
+
+protected:
+    int column(double x) const;
+    int row(double y) const;
+
+    int columns;
+    int rows;
+
+    /* players in cell i are entries[start[i]] up to entries[start[i + 1]] */
+    std::vector<unsigned int> start;
+    std::vector<unsigned int> entries;
+    /* cell of each player, only used while rebuilding */
+    std::vector<unsigned int> cells;
 };
 
 class Team{
@@ -310,11 +583,10 @@ public:
         RightSide
     };
 
-    enum Input{
-        Cycle
-    };
-
-    Team(Side side, const Field & field);
+    /* count is the number of players on the court, not counting the sideline.
+     * The world only has to be constructed up to its teams.
+     */
+    Team(Side side, World & world, bool human, int count);
 
     void enableControl();
     void cycleControl(World & world);
@@ -323,6 +595,17 @@ public:
     Side getSide() const;
             
     void collisionDetection(World & world, Ball & ball);
+    /* every ball is binned into the grid at once, then the hits are
+     * resolved in the order of the balls
+     */
+    void collisionDetection(World & world, const std::vector<Ball*> & balls);
+
+    /* index of the first player the ball touches or -1. Without the grid
+     * every player is checked, which is only useful for comparison.
+     */
+    int findHit(const Ball & ball, bool useGrid = true);
+    /* findHit for each ball in one pass over the grid */
+    void findHits(const std::vector<Ball*> & balls, std::vector<int> & hits);
 
     void draw(const Graphics::Bitmap & work, const Camera & camera);
 
@@ -333,16 +616,42 @@ public:
 
     bool onTeam(const Player * who) const;
 
-    void act(World & world);
+    /* buttons are ignored unless the team is human */
+    void act(World & world, unsigned int buttons);
+    void afterPhysics(World & world);
     const std::vector<Util::ReferenceCount<Player> > & getPlayers() const;
 
+    bool isHuman() const;
+
+    /* holding on to the players keeps the dead ones around for a restore */
+    struct State{
+        Controls controls;
+        std::vector<Util::ReferenceCount<Player> > players;
+        std::vector<Player::State> states;
+    };
+
+    void save(State & state) const;
+    void restore(const State & state);
+
 protected:
-    void populateLeft(const Field & field);
-    void populateRight(const Field & field);
+    void populateLeft(World & world, bool human, int count);
+    void populateRight(World & world, bool human, int count);
 
     std::vector<Util::ReferenceCount<Player> > players;
     Side side;
-    InputMap<Input> map;
+    /* true if a person controls this team */
+    bool human;
+    /* what the person pressed this tick, shared with the human behaviors */
+    Controls controls;
+
+    PlayerGrid grid;
+    void resolveHit(World & world, Ball & ball, int hit);
+
+    /* scratch space for grid queries */
+    std::vector<unsigned int> nearby;
+    /* cell and ball, for findHits */
+    std::vector<std::pair<unsigned int, unsigned int> > binned;
+    std::vector<int> hits;
 };
 
 class Ball: public Drawable {
@@ -352,7 +661,7 @@ public:
         Blaster
     };
 
-    Ball(double x, double y);
+    Ball(double x, double y, double angle);
 
     double getX() const;
     double getY() const;
@@ -386,12 +695,39 @@ public:
 
     void draw(const Graphics::Bitmap & work, const Camera & camera);
 
+    /* How many pieces the last move has to be split into so that no piece
+     * is long enough to pass through a player. 1 for slow balls.
+     */
+    void beginSteps();
+    int getSteps() const;
+    /* put the ball at the end of the given piece of the last move, 1 to getSteps() */
+    void moveToStep(int step);
+
+    /* A ball that reaches the ground in act() is still in the air and
+     * thrown until this is called after collision detection, so the whole
+     * path it took that tick gets checked.
+     */
+    void land();
+
     double x;
     double y;
     /* z will be the in-air coordinate */
     double z;
     double angle;
 
+    /* where the ball was at the start of the last act */
+    double lastX;
+    double lastY;
+    double lastZ;
+
+    /* where the ball ended up after the last act, used while sub-stepping */
+    double toX;
+    double toY;
+    double toZ;
+    int steps;
+    /* touched the ground in the last act, see land() */
+    bool landing;
+
     double velocityX;
     double velocityY;
     double velocityZ;
@@ -419,6 +755,15 @@ public:
     void draw(const Graphics::Bitmap & work, const Camera & camera);
     bool alive();
 
+    struct State{
+        double z;
+        int life;
+        int angle;
+    };
+
+    void save(State & state) const;
+    void restore(const State & state);
+
 protected:
     double x, y, z;
     int life;
@@ -426,6 +771,54 @@ protected:
     const std::string text;
 };
 
+/* A copy of everything in a World that changes from tick to tick. Players
+ * and balls are referred to by pointer so a snapshot can only be restored
+ * into the World that saved it. Reusing one snapshot for many saves only
+ * allocates when the match grows past what it has seen before.
+ */
+class Snapshot{
+public:
+    Snapshot();
+
+    /* bytes held by the snapshot, not counting the shared animation frames */
+    unsigned int size() const;
+
+protected:
+    friend class World;
+
+    Camera camera;
+    uint64_t random;
+    unsigned int time;
+    unsigned int hits;
+    Bodies bodies;
+    std::vector<Ball> balls;
+    Team::State team1;
+    Team::State team2;
+    std::vector<Util::ReferenceCount<FloatingText> > floatingText;
+    std::vector<FloatingText::State> floatingStates;
+};
+
+/* How a match is set up */
+struct MatchSettings{
+    MatchSettings(unsigned int seed);
+
+    /* all randomness in the match comes from the seed */
+    unsigned int seed;
+    /* teams played by a person instead of the ai */
+    bool humanLeft;
+    bool humanRight;
+    /* players on the court for each team, not counting the sideline */
+    int players;
+    /* at least 1 */
+    int balls;
+
+    /* NULL means the process wide instance(), which is only safe to use
+     * from the main thread. Worlds on other threads need their own.
+     */
+    Util::ReferenceCount<AnimationManager> animations;
+    Util::ReferenceCount<SoundManager> sounds;
+};
+
 class World{
 public:
     enum Input{
@@ -434,12 +827,18 @@ public:
         Up,
         Down,
         ZoomIn,
-        ZoomOut
+        ZoomOut,
+        ToggleProfile
     };
 
-    World();
+    World(const MatchSettings & settings);
 
+    /* reads the keyboard for the human teams, unless headless */
     void run();
+    /* the buttons run() would use, also handles the camera keys */
+    void readInput(unsigned int & left, unsigned int & right);
+    /* one tick where the human teams press the given Controls buttons */
+    void run(unsigned int left, unsigned int right);
     
     Util::ReferenceCount<Player> getTarget(Player & who);
     Util::ReferenceCount<Player> getTarget(const std::vector<Util::ReferenceCount<Player> > & players, Player & who);
@@ -460,6 +859,9 @@ public:
     void draw(const Graphics::Bitmap & screen);
 
     void drawOverlay(const Graphics::Bitmap & work);
+    /* per phase times, only filled in when built with DODGEBALL_PROFILE */
+    void drawProfile(const Graphics::Bitmap & work);
+    const Profile::Times & getProfile() const;
 
     void collisionDetection();
     
@@ -469,52 +871,290 @@ public:
 
     unsigned int getTime() const;
 
-    std::vector<Drawable*> getDrawables();
+    Random & getRandom();
+    unsigned int getSeed() const;
+
+    Bodies & getBodies();
+    AnimationManager & getAnimations();
+    SoundManager & getSounds();
+    /* returns the sounds that were being used */
+    Util::ReferenceCount<SoundManager> setSounds(const Util::ReferenceCount<SoundManager> & sounds);
+
+    enum SoundEffect{
+        HitSound,
+        ThrowSound,
+        SuperSound,
+        SoundEffects
+    };
+
+    void playSound(SoundEffect effect);
+
+    /* number of players hit by a thrown ball */
+    void addHit();
+    unsigned int getHits() const;
+
+    /* Hash of the positions, health and random state. Two worlds that were
+     * given the same seed and buttons hash the same.
+     */
+    uint32_t hash() const;
+
+    /* save and restore take a few microseconds, so it is fine to do every tick */
+    void save(Snapshot & snapshot) const;
+    void restore(const Snapshot & snapshot);
+
+    /* Everything to draw, back to front. The list is kept between frames
+     * and only needs a short insertion pass to fix up what moved.
+     */
+    const std::vector<Drawable*> & getDrawables();
+
+    /* called as players and floating text come and go */
+    void addDrawable(Drawable * drawable);
+    void removeDrawable(Drawable * drawable);
+
+    /* the animation of every player, for AnimationManager::release() */
+    void playing(std::vector<const Animation*> & out) const;
 
     bool onTeam(const Team & team, const Player & who);
 
     const Field & getField() const;
-    Ball & getBall();
+    std::vector<Ball> & getBalls();
+    Ball & closestBall(const Player & who);
 
     Camera camera;
     Field field;
-    Ball ball;
+    const unsigned int seed;
+    Random random;
+    /* must be declared before the teams so they outlive the players */
+    Util::ReferenceCount<AnimationManager> animations;
+    Util::ReferenceCount<SoundManager> sounds;
+    /* handles from sounds for each effect */
+    SoundHandle soundHandles[SoundEffects];
+    /* Rollback swaps the same two managers back and forth every tick, so
+     * the handles of the one swapped out are kept to swap back in. Holding
+     * on to it means a freed manager's address can't be mistaken for it.
+     */
+    Util::ReferenceCount<SoundManager> otherSounds;
+    SoundHandle otherHandles[SoundEffects];
+    Bodies bodies;
+    /* never resized after construction, players point into it */
+    std::vector<Ball> balls;
     Team team1;
     Team team2;
     InputMap<Input> map;
+    KeyboardControls keyboard;
+    Profile::Times profile;
+    bool showProfile;
     unsigned int time;
+    unsigned int hits;
     std::vector<Util::ReferenceCount<FloatingText> > floatingText;
+
+protected:
+    /* after a restore the players and text can be entirely different */
+    void rebuildDrawables();
+
+    /* sorted by Drawable::order as of the last getDrawables() */
+    std::vector<Drawable*> drawables;
+
+    /* scratch space for collisionDetection */
+    std::vector<Ball*> moving;
+    std::vector<Ball*> against1;
+    std::vector<Ball*> against2;
+    std::vector<Ball*> passes;
 };
 
+/* Sounds are played through a fixed pool of voices. A play only claims a
+ * voice, the voices all start together when the tick ends. A sound can only
+ * take so many voices in one tick, so a dozen hits landing at once play
+ * the hit sound once instead of stacking into distortion, and once the
+ * pool is full the rest of the tick's sounds are dropped.
+ *
+ * Sounds are decoded when they load and mixed into the Mixer's stream by
+ * the sound device, which instance() opens before any match starts. If it
+ * can't be opened instance() gives the silent manager instead, which is
+ * also what is used when headless.
+ */
 class SoundManager{
 protected:
     SoundManager();
-    std::map<Path::RelativePath, Util::ReferenceCount<Sound> > sounds;
+    std::map<Path::RelativePath, Util::ReferenceCount<Pcm> > sounds;
     static Util::ReferenceCount<SoundManager> manager;
 
 public:
     virtual ~SoundManager();
     static Util::ReferenceCount<SoundManager> instance();
     static void destroy();
-    Util::ReferenceCount<Sound> getSound(const Path::RelativePath & path);
+
+    /* a manager that never loads or plays anything */
+    static Util::ReferenceCount<SoundManager> silent();
+    Util::ReferenceCount<Pcm> getSound(const Path::RelativePath & path);
+
+    /* A sound looked up once so playing it is an array index instead of a
+     * path and a map lookup. Only good for the manager that gave it out.
+     */
+    typedef SoundHandle Handle;
+    Handle getHandle(const Path::RelativePath & path);
+
+    /* load the sound ahead of time so the first play doesn't stall */
+    virtual void preload(const Path::RelativePath & path);
+    void play(const Path::RelativePath & path);
+    virtual void play(Handle handle);
+
+    /* starts the voices claimed since the last flush, once per tick */
+    virtual void flush();
+    /* From the main loop, never inside World::run. Picks up the sound
+     * volume and fills the stream on backends that don't ask for it from a
+     * thread of their own.
+     */
+    void poll();
+
+    static const unsigned int voices = 16;
+    static const unsigned int repeatsPerTick = 1;
+
+    /* Loads a sound without touching any manager, so it can run on another
+     * thread. pack may be NULL.
+     */
+    static Util::ReferenceCount<Pcm> loadSound(const AssetPack * pack, const Path::RelativePath & path);
+    /* Storage isn't safe to use off the main thread, so a loader looks the
+     * file up first with locateSound(), which is empty if the pack has it,
+     * and the other thread only reads it.
+     */
+    static Filesystem::AbsolutePath locateSound(const AssetPack * pack, const Path::RelativePath & path);
+    static Util::ReferenceCount<Pcm> loadSound(const AssetPack * pack, const Path::RelativePath & path, const Filesystem::AbsolutePath & file);
+
+    /* Someone is loading the sound in the background. Until add() is called
+     * with it, playing the sound does nothing rather than loading it again.
+     * Adding a NULL sound means it failed and play() will load it itself.
+     */
+    void expect(const Path::RelativePath & path);
+    void add(const Path::RelativePath & path, const Util::ReferenceCount<Pcm> & sound);
+
+protected:
+    std::set<Path::RelativePath> pending;
+
+    /* by handle, a sound is NULL until the first time it plays */
+    std::map<Path::RelativePath, Handle> handles;
+    std::vector<Path::RelativePath> handlePaths;
+    std::vector<Util::ReferenceCount<Pcm> > handleSounds;
+    /* voices each sound has claimed this tick */
+    std::vector<unsigned int> claimed;
+
+    Handle voice[voices];
+    unsigned int used;
+
+    /* last so its thread stops before the sounds it reads go away */
+    Util::ReferenceCount<Mixer> mixer;
 };
 
 class AnimationManager{
 public:
+    /* Most code should use instance(). A separate manager is only needed to
+     * run a World on another thread.
+     */
+    AnimationManager();
+    /* characters in the pack are loaded from it, pack is not owned and may be NULL */
+    explicit AnimationManager(const AssetPack * pack);
     virtual ~AnimationManager();
 
     static Util::ReferenceCount<AnimationManager> instance();
     static void destroy();
 
     Util::ReferenceCount<Animation> getAnimation(const std::string & path, const std::string & animation);
+    /* every animation of a character by name */
+    const std::map<std::string, Util::ReferenceCount<Animation> > & getAnimations(const std::string & path);
+    /* lives as long as the manager */
+    const AnimationSet & getSet(const std::string & path);
+
+    /* Loads a character without touching the manager's maps, so it can
+     * run on another thread while the manager is in use.
+     */
+    std::map<std::string, Util::ReferenceCount<Animation> > loadAnimations(const std::string & path) const;
+    /* The same but with the directory already looked up by locate(), so
+     * Storage is only used on the main thread. If the pack has the character
+     * the directory is only used when the pack's copy is damaged, and is
+     * empty if there are no loose files.
+     */
+    Filesystem::AbsolutePath locate(const std::string & path) const;
+    /* Frames whose hash is in known are left out of the new atlas, add()
+     * points them at the frame the manager already has. Take known from
+     * knownFrames() on the main thread.
+     */
+    std::map<std::string, Util::ReferenceCount<Animation> > loadAnimations(const std::string & path, const Filesystem::AbsolutePath & directory, const std::set<uint32_t> & known) const;
+    std::set<uint32_t> knownFrames() const;
+    /* a character loaded with loadAnimations() */
+    void add(const std::string & path, const std::map<std::string, Util::ReferenceCount<Animation> > & animations);
+    bool has(const std::string & path) const;
+
+    /* how many threads decode the frames of a character, one per processor
+     * unless set
+     */
+    void setDecodeThreads(unsigned int threads);
+
+    /* What the decoded frames of every loaded character take, next to what
+     * they would take if every frame of every animation had its own image.
+     * A frame two characters share counts for both but only once in the
+     * total. Everything is zero when headless.
+     */
+    void report(std::ostream & out) const;
+
+    /* Watch the files of every character, loaded already or later, so
+     * reload() can pick up edits. Reloading changes how a match plays, so
+     * leave it off for replays and netplay.
+     */
+    void enableReload();
+
+    /* Call between ticks. Reparses the animations whose anim block or
+     * frames changed on disk and swaps them all in at once. A player keeps
+     * playing the animation it already started, the next one it starts is
+     * the new one. If anything fails to load nothing is swapped.
+     */
+    void reload();
+
+    /* Call between ticks after reload(). Drops the replaced animations no
+     * player of the world is still playing. Snapshots hold cursors too, so
+     * this is only right when none are kept, which reload already needs.
+     */
+    void release(const World & world);
 
 protected:
-    AnimationManager();
-    std::map<std::string, Util::ReferenceCount<Animation> > loadAnimations(const std::string & path);
+    /* what a character was last loaded from, to tell which animations a
+     * changed file affects
+     */
+    struct Watched{
+        Filesystem::AbsolutePath directory;
+        std::string definition;
+        /* every anim block as text, by name */
+        std::map<std::string, std::string> blocks;
+        /* full path of every frame to the animations using it */
+        std::map<std::string, std::set<std::string> > frames;
+    };
+
+    static unsigned int defaultDecodeThreads();
+
+    void watch(const std::string & path);
+    void readWatched(Watched & watched, const Token * token) const;
+    /* Points the frames of a freshly loaded character at any frame another
+     * character already has and, if keep, adds the rest to shared. Only a
+     * lookup per frame, the atlas was packed by whoever loaded it. Changes
+     * shared so it is only called on the main thread.
+     */
+    void share(const std::map<std::string, Util::ReferenceCount<Animation> > & animations, bool keep);
+    void reload(const std::string & path, bool definition, std::set<std::string> animations);
 
     static Util::ReferenceCount<AnimationManager> manager; 
     std::map<std::string, std::map<std::string, Util::ReferenceCount<Animation> > > sets;
-    unsigned int id;
+    std::map<std::string, Util::ReferenceCount<AnimationSet> > characters;
+    const AssetPack * pack;
+    unsigned int decodeThreads;
+    /* Every frame of every character by the hash of its pixels, so a frame
+     * one character already has is never stored again for another. Frames
+     * from a reload aren't kept here or it would grow with every edit.
+     */
+    std::map<uint32_t, FrameTable::Frame> shared;
+
+    Util::ReferenceCount<FileWatcher> watcher;
+    std::map<std::string, Watched> watched;
+    /* animations that were replaced, cursors may still point at them */
+    std::vector<Util::ReferenceCount<Animation> > retired;
 };
 
 }